@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Install two revisions of multicorn in turn, and run bench/trampoline.sh
+# against each of them, to compare the throughput of a foreign scan before
+# and after a change.
+#
+# Usage: bench/compare_builds.sh before-rev [after-rev [rows]]
+#
+# after-rev defaults to HEAD. Each revision is built and installed with
+# "make install" into the PostgreSQL found by pg_config, which needs write
+# access to its directories, and the last one stays installed. The python
+# package of the current tree is installed after each of them, for the
+# nb_rows option of testfdw. The other requirements of bench/trampoline.sh
+# apply.
+set -eu
+
+BEFORE=$1
+AFTER=${2:-HEAD}
+ROWS=${3:-1000000}
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+TOPDIR=$(dirname "$BENCHDIR")
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+for REV in "$BEFORE" "$AFTER"; do
+	git -C "$TOPDIR" archive --prefix=multicorn/ "$REV" | tar -x -C "$WORKDIR"
+	make -s -C "$WORKDIR/multicorn" install >/dev/null
+	make -s -C "$TOPDIR" python_code >/dev/null
+	rm -rf "$WORKDIR/multicorn"
+	printf '%-10s' "$REV:"
+	"$BENCHDIR/trampoline.sh" "$ROWS"
+done | awk '{ print } $NF == "us/row" { rate[++n] = $(NF - 3) }
+	END {
+		if (n == 2 && rate[1] > 0)
+			printf "after/before: %.2fx rows/sec\n", rate[2] / rate[1]
+	}'
@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Report the throughput of a foreign scan returning values of each type
+# with its own python to datum converter.
+#
+# Usage: bench/converters.sh [rows] [types...]
+#
+# The same requirements as bench/trampoline.sh apply.
+set -eu
+
+ROWS=${1:-1000000}
+[ $# -gt 0 ] && shift
+PSQL=${PSQL:-psql}
+BENCHDIR=$(dirname "$0")
+
+[ $# -gt 0 ] || set -- numeric uuid bytea text
+
+for TYPE in "$@"; do
+	$PSQL -X -q -v ON_ERROR_STOP=1 -v rows="$ROWS" -v type="$TYPE" \
+		-f "$BENCHDIR/converters.sql" |
+		awk -v rows="$ROWS" -v type="$TYPE" '/^Time:/ {
+			printf "%-8s %d rows in %.1f ms: %.0f rows/sec, %.3f us/row\n",
+				type ":", rows, $2, rows * 1000 / $2, $2 * 1000 / rows
+		}'
+done
@@ -0,0 +1,23 @@
+-- Scan a large foreign table with a single column, and time it.
+-- Expects the "rows" and "type" psql variables to be set.
+SET client_min_messages=WARNING;
+CREATE EXTENSION IF NOT EXISTS multicorn;
+DROP SERVER IF EXISTS multicorn_bench_srv CASCADE;
+CREATE server multicorn_bench_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE foreign table multicorn_bench (
+    value :type
+) server multicorn_bench_srv options (
+    test_type 'types',
+    nb_rows :'rows'
+);
+
+-- Warm up: load python, and cache the instance.
+select count(value) from multicorn_bench;
+
+\timing on
+select count(value) from multicorn_bench;
+\timing off
+
+DROP SERVER multicorn_bench_srv CASCADE;
@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Run the same foreign scan through the plpython trampoline and with
+# direct calls into python (see multicorn.execution_mode), and report the
+# cost of the trampoline for each IterateForeignScan call.
+#
+# Usage: bench/execution_modes.sh [rows]
+#
+# The same requirements as bench/trampoline.sh apply, and plpython must
+# be installed.
+set -eu
+
+ROWS=${1:-1000000}
+BENCHDIR=$(dirname "$0")
+
+for MODE in plpython direct; do
+	printf '%-10s' "$MODE:"
+	PGOPTIONS="${PGOPTIONS:-} -c multicorn.execution_mode=$MODE" \
+		"$BENCHDIR/trampoline.sh" "$ROWS"
+done | awk '{ print } $NF == "us/row" { us[$1] = $(NF - 1) }
+	END {
+		if (("plpython:" in us) && ("direct:" in us))
+			printf "trampoline overhead: %.3f us/call\n",
+				us["plpython:"] - us["direct:"]
+	}'
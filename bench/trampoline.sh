@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# Report the throughput of a foreign scan going through multicorn.
+#
+# Usage: bench/trampoline.sh [rows]
+#
+# The multicorn extension and python package must be installed. The
+# database is selected with the usual libpq environment variables
+# (PGDATABASE, PGHOST, ...).
+set -eu
+
+ROWS=${1:-1000000}
+PSQL=${PSQL:-psql}
+BENCHDIR=$(dirname "$0")
+
+$PSQL -X -q -v ON_ERROR_STOP=1 -v rows="$ROWS" -f "$BENCHDIR/trampoline.sql" |
+	awk -v rows="$ROWS" '/^Time:/ {
+		printf "%d rows in %.1f ms: %.0f rows/sec, %.3f us/row\n",
+			rows, $2, rows * 1000 / $2, $2 * 1000 / rows
+	}'
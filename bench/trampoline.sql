@@ -0,0 +1,24 @@
+-- Scan a large foreign table, and time it.
+-- Expects the "rows" psql variable to be set.
+SET client_min_messages=WARNING;
+CREATE EXTENSION IF NOT EXISTS multicorn;
+DROP SERVER IF EXISTS multicorn_bench_srv CASCADE;
+CREATE server multicorn_bench_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE foreign table multicorn_bench (
+    test1 integer,
+    test2 integer
+) server multicorn_bench_srv options (
+    test_type 'int',
+    nb_rows :'rows'
+);
+
+-- Warm up: load python, and cache the instance.
+select count(*) from multicorn_bench;
+
+\timing on
+select count(*) from multicorn_bench;
+\timing off
+
+DROP SERVER multicorn_bench_srv CASCADE;
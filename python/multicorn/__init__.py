@@ -76,6 +76,12 @@ class Qual(object):
             is the internal representation of WHERE field IN (1, 2, 3)
         value (object): The constant value on the right side
 
+            smallint, integer and bigint values are ints, real and double
+            precision values are floats, and booleans are bools. Before
+            1.4.1, smallint, bigint, real, double precision and boolean
+            values were passed as their text (str). Reals are widened to
+            doubles as they are, so 0.1::real is 0.10000000149011612.
+
 
     """
 
@@ -90,6 +96,8 @@ class Qual(object):
         self.field_name = field_name
         self.operator = operator
         self.value = value
+        self._value_set = None
+        self._value_set_source = None
 
     @property
     def is_list_operator(self):
@@ -118,6 +126,39 @@ class Qual(object):
             return ANY if self.operator[1] else ALL
         return None
 
+    @property
+    def value_set(self):
+        """
+        Returns:
+            A frozenset of the values of a list operator, or None if this is
+            not a list operator. It is only built once for each value of the
+            qual, and makes testing whether a row matches a long IN list take
+            constant time. It is None as well when the values cannot be
+            hashed, such as the dicts of json values: test membership against
+            :attr:`value` then.
+        """
+        if not self.is_list_operator or self.value is None:
+            return None
+        if self._value_set_source is not self.value:
+            try:
+                self._value_set = frozenset(self.value)
+            except TypeError:
+                self._value_set = None
+            self._value_set_source = self.value
+        return self._value_set
+
+    @property
+    def value_count(self):
+        """
+        Returns:
+            The number of values of a list operator, for example to estimate
+            the number of rows in :meth:`ForeignDataWrapper.get_rel_size`, or
+            None if this is not a list operator.
+        """
+        if not self.is_list_operator or self.value is None:
+            return None
+        return len(self.value)
+
     def __repr__(self):
         if self.is_list_operator:
             value = '%s(%s)' % (
@@ -140,6 +181,136 @@ class Qual(object):
         return hash((self.field_name, self.operator, self.value))
 
 
+class BoolQual(object):
+    """A BoolQual combines other qualifiers with a boolean operator.
+
+    For example::
+
+        mycolumn > 3 OR othercolumn IS NULL
+
+    It is only given to foreign data wrappers setting
+    :attr:`ForeignDataWrapper.bool_quals`.
+
+    Attributes:
+        operator (str): One of 'and', 'or' and 'not'.
+        quals (list): The :class:`Qual` and :class:`BoolQual` instances
+            combined. A 'not' has exactly one of them.
+    """
+
+    def __init__(self, operator, quals):
+        self.operator = operator
+        self.quals = quals
+
+    def __repr__(self):
+        if self.operator == 'not':
+            return "NOT (%r)" % self.quals[0]
+        return "(%s)" % (" %s " % self.operator.upper()).join(
+            repr(qual) for qual in self.quals)
+
+    def __eq__(self, other):
+        if isinstance(other, BoolQual):
+            return (self.operator == other.operator and
+                    self.quals == other.quals)
+        return False
+
+    def __hash__(self):
+        return hash((self.operator, tuple(self.quals)))
+
+
+class Column(object):
+    """A column of the foreign table, in an :class:`ExpressionQual`.
+
+    Attributes:
+        name (str): The name of the column.
+    """
+
+    def __init__(self, name):
+        self.name = name
+
+    def __repr__(self):
+        return self.name
+
+    def __eq__(self, other):
+        if isinstance(other, Column):
+            return self.name == other.name
+        return False
+
+    def __hash__(self):
+        return hash(self.name)
+
+
+class FunctionCall(object):
+    """A function call, in an :class:`ExpressionQual`.
+
+    Attributes:
+        name (str): The name of the PostgreSQL function.
+        schema (str): The schema of the function. Check it before
+            translating the call to a function of the remote side: a
+            ``lower`` function in another schema than ``pg_catalog`` is not
+            the builtin one.
+        args (list): Its arguments, each one being a :class:`Column`, a
+            :class:`FunctionCall`, or a constant value.
+    """
+
+    def __init__(self, name, args, schema='pg_catalog'):
+        self.name = name
+        self.args = args
+        self.schema = schema
+
+    def __repr__(self):
+        name = self.name
+        if self.schema != 'pg_catalog':
+            name = '%s.%s' % (self.schema, name)
+        return "%s(%s)" % (name, ", ".join(repr(arg) for arg in self.args))
+
+    def __eq__(self, other):
+        if isinstance(other, FunctionCall):
+            return (self.schema == other.schema and
+                    self.name == other.name and self.args == other.args)
+        return False
+
+    def __hash__(self):
+        return hash((self.schema, self.name, tuple(self.args)))
+
+
+class ExpressionQual(object):
+    """An ExpressionQual is a qualifier applying to functions of the columns,
+    or comparing columns with each other.
+
+    For example::
+
+        lower(mycolumn) = 'value'
+        mycolumn < othercolumn
+
+    It is only given to foreign data wrappers setting
+    :attr:`ForeignDataWrapper.expression_quals`.
+
+    Attributes:
+        left (Column or FunctionCall): The left operand.
+        operator (str): The operator, as for :class:`Qual`.
+        value: The right operand, which is a :class:`Column` or a
+            :class:`FunctionCall` referencing the columns, or else a value.
+    """
+
+    def __init__(self, left, operator, value):
+        self.left = left
+        self.operator = operator
+        self.value = value
+
+    def __repr__(self):
+        return "%r %s %s" % (self.left, self.operator, self.value)
+
+    def __eq__(self, other):
+        if isinstance(other, ExpressionQual):
+            return (self.left == other.left and
+                    self.operator == other.operator and
+                    self.value == other.value)
+        return False
+
+    def __hash__(self):
+        return hash((self.left, self.operator, self.value))
+
+
 
 
 
@@ -153,6 +324,39 @@ class ForeignDataWrapper(object):
 
     _startup_cost = 20
 
+    projected_sequences = False
+    """Set to True if :meth:`execute` returns sequences holding only the
+    requested columns. The columns are then given to :meth:`execute` as a
+    list, in the order the values must appear in each sequence.
+    """
+
+    bool_quals = False
+    """Set to True to also receive the OR, AND and NOT expressions of the
+    where clause as :class:`BoolQual` instances, along with the
+    :class:`Qual` ones. Expressions of which a part cannot be represented
+    are left out.
+    """
+
+    expression_quals = False
+    """Set to True to also receive the conditions on functions of the
+    columns, or comparing columns with each other, as
+    :class:`ExpressionQual` instances.
+    """
+
+    lazy_rows = False
+    """Set to True to have :meth:`insert` and :meth:`update` receive
+    read-only mappings instead of dictionaries. Their values are only
+    converted from PostgreSQL when looked up, which saves time on wide rows
+    of which only a few columns are used. Use ``dict(values)`` to get a
+    regular dictionary.
+
+    The mappings are registered as :class:`collections.abc.Mapping`, and
+    compare equal to the dictionaries holding the same columns. If a
+    column cannot be converted, looking it up raises a ValueError with the
+    PostgreSQL error message. The conversion runs in its own subtransaction,
+    so the method may catch the ValueError and go on.
+    """
+
     def __init__(self, fdw_options, fdw_columns):
         """The foreign data wrapper is initialized on the first query.
 
@@ -186,6 +390,28 @@ class ForeignDataWrapper(object):
         """
         return (100000000, len(columns) * 100)
 
+    def get_exact_quals(self, quals):
+        """
+        Method called from the planner to ask the FDW which quals it enforces
+        itself, so that PostgreSQL does not check them again on every
+        returned row.
+
+        Only the quals whose value is known at planning time are given, and
+        this is only taken into account from PostgreSQL 9.5. It is not
+        called unless overridden.
+
+        Args:
+            quals (list): A list of :class:`Qual` instances, as well as
+                :class:`BoolQual` and :class:`ExpressionQual` ones if
+                :attr:`bool_quals` and :attr:`expression_quals` are set.
+
+        Returns:
+            The quals, among those given, that every row returned by
+            :meth:`execute` satisfies. They must be the given instances
+            themselves: other quals comparing equal to them are ignored.
+        """
+        return []
+
     def can_sort(self, sortkeys):
         """
         Method called from the planner to ask the FDW what are the sorts it can
@@ -287,7 +513,9 @@ class ForeignDataWrapper(object):
         This is where the actual remote query execution takes place. Multicorn
         makes no assumption about the particular behavior of a
         ForeignDataWrapper, and will NOT remove any qualifiers from the
-        PostgreSQL quals list. That means the quals will be rechecked anyway.
+        PostgreSQL quals list, except those returned by
+        :meth:`get_exact_quals`. That means the other quals will be rechecked
+        anyway.
 
         Typically, an implementation would:
 
@@ -306,11 +534,17 @@ class ForeignDataWrapper(object):
 
         Args:
             quals (list): A list of :class:`Qual` instances, containing the basic
-                where clauses in the query.
+                where clauses in the query. Quals compared to a constant
+                are the same instances for every execution of a scan, such
+                as the rescans of a nested loop, and must not be modified.
+                Those compared to a parameter are built again for each
+                execution.
             columns (list):  A list of columns that postgresql is going to need.
                 You should return AT LEAST those columns when returning a
                 dict. If returning a sequence, every column from the table
-                should be in the sequence.
+                should be in the sequence, unless :attr:`projected_sequences`
+                is set: the sequence then holds the values of these columns
+                only, in the same order.
             sortkeys (list): A list of :class:`SortKey`
                 that the FDW said it can enforce.
 
@@ -318,7 +552,8 @@ class ForeignDataWrapper(object):
             An iterable of python objects which can be converted back to PostgreSQL.
             Currently, such objects are:
             - sequences containing exactly as much columns as the
-            underlying tables
+            underlying tables, or as the requested columns with
+            :attr:`projected_sequences`
             - dictionaries mapping column names to their values.
             If the sortkeys wasn't empty, the FDW has to return the data in the
             expected order.
@@ -1,10 +1,33 @@
 # -*- coding: utf-8 -*-
-from multicorn import ForeignDataWrapper, TableDefinition, ColumnDefinition
+from multicorn import (ForeignDataWrapper, TableDefinition, ColumnDefinition,
+                       Qual)
 from multicorn.compat import unicode_
 from .utils import log_to_postgres, WARNING, ERROR
 from itertools import cycle
-from datetime import datetime
+from datetime import datetime, timedelta, tzinfo
+from decimal import Decimal
+from uuid import UUID
 from operator import itemgetter
+try:
+    from collections.abc import Mapping
+except ImportError:
+    from collections import Mapping
+
+
+class FixedOffset(tzinfo):
+    """A time zone at a fixed offset, in minutes, east of UTC."""
+
+    def __init__(self, minutes):
+        self._offset = timedelta(minutes=minutes)
+
+    def utcoffset(self, dt):
+        return self._offset
+
+    def tzname(self, dt):
+        return None
+
+    def dst(self, dt):
+        return timedelta(0)
 
 
 class TestForeignDataWrapper(ForeignDataWrapper):
@@ -17,6 +40,16 @@ class TestForeignDataWrapper(ForeignDataWrapper):
         self.test_type = options.get('test_type', None)
         self.test_subtype = options.get('test_subtype', None)
         self.tx_hook = options.get('tx_hook', False)
+        self.nb_rows = int(options.get('nb_rows', 20))
+        self.projected_sequences = (
+            options.get('projected_sequences') == 'true')
+        self.lazy_rows = options.get('lazy_rows') == 'true'
+        self._kept_rows = []
+        self._kept_quals = []
+        self.bool_quals = options.get('bool_quals') == 'true'
+        self.exact_quals = options.get('exact_quals') in ('true', 'copies')
+        self.copy_exact_quals = options.get('exact_quals') == 'copies'
+        self.expression_quals = options.get('expression_quals') == 'true'
         self._row_id_column = options.get('row_id_column',
                                           list(self.columns.keys())[0])
         log_to_postgres(str(sorted(options.items())))
@@ -32,10 +65,19 @@ class TestForeignDataWrapper(ForeignDataWrapper):
 
     def _as_generator(self, quals, columns):
         random_thing = cycle([1, 2, 3])
-        for index in range(20):
+        if self.exact_quals:
+            exact = self.get_exact_quals(quals)
+        else:
+            exact = []
+        for index in range(self.nb_rows):
             if self.test_type == 'sequence':
                 line = []
-                for column_name in self.columns:
+                if (self.projected_sequences and
+                        self.test_subtype != 'full_width'):
+                    column_names = columns
+                else:
+                    column_names = self.columns
+                for column_name in column_names:
                     if self.test_subtype == '1null' and len(line) == 0:
                         line.append(None)
                     else:
@@ -71,20 +113,111 @@ class TestForeignDataWrapper(ForeignDataWrapper):
                             [index, '%s,"%s"' % (column_name, index)]]
                     elif self.test_type == 'float':
                         line[column_name] = 1. / float(next(random_thing))
+                    elif self.test_type == 'numbers':
+                        line[column_name] = self._number(column, index)
+                    elif self.test_type == 'datetime':
+                        line[column_name] = self._datetime(column_name,
+                                                           index)
+                    elif self.test_type == 'array':
+                        line[column_name] = self._array(column_name, index)
+                    elif self.test_type == 'json':
+                        line[column_name] = self._json(column, index)
+                    elif self.test_type == 'bytes':
+                        line[column_name] = self._bytes(column_name, index)
+                    elif self.test_type == 'types':
+                        line[column_name] = self._typed(column, index)
                     else:
                         line[column_name] = '%s %s %s' % (column_name,
                                                           next(random_thing),
                                                           index)
+                if any(line.get(qual.field_name) not in
+                       (qual.value if qual.value_set is None
+                        else qual.value_set)
+                       if qual.is_list_operator
+                       else line.get(qual.field_name) != qual.value
+                       for qual in exact):
+                    continue
             yield line
 
+    def _number(self, column, index):
+        if self.test_subtype == 'overflow':
+            return 70000 + index
+        if column.type_name == 'boolean':
+            return index % 2 == 0
+        if column.type_name == 'bigint':
+            return index * 2 ** 40
+        if column.type_name == 'double precision':
+            return index / 4.
+        return index
+
+    def _datetime(self, column_name, index):
+        value = datetime(2011, index + 1, 2, 14, 30, 25, 123456)
+        if column_name == 'test_aware':
+            return value.replace(tzinfo=FixedOffset(120))
+        if column_name == 'test_date':
+            return value.date()
+        if column_name == 'test_time':
+            return value.time()
+        return value
+
+    def _array(self, column_name, index):
+        if column_name == 'test_int':
+            return list(range(index))
+        if column_name == 'test_text':
+            return ('row %s' % index, None, 'with "quotes", {braces}')
+        if column_name == 'test_matrix':
+            return [[index, index + 1], [index + 2, None]]
+        return [index / 4., index]
+
+    def _json(self, column, index):
+        if column.type_name == 'jsonb':
+            return {'name': 'row %s' % index, 'index': index,
+                    'ratio': index / 4., 'big': 2 ** 70,
+                    'tags': ['a', None, True, False],
+                    'nested': {'quote': 'say "hi"\\'}}
+        if column.type_name == 'json':
+            return [index, index / 4., 'say "hi"', None, True,
+                    {'key': 'row %s' % index}]
+        return {'key': 'row %s' % index, 'index': index, 'empty': None}
+
+    def _bytes(self, column_name, index):
+        if column_name == 'test_bytes':
+            return b'\x00bytes'
+        if column_name == 'test_bytearray':
+            return bytearray([0, 1, index, 255])
+        if column_name == 'test_memoryview':
+            return memoryview(('view %s' % index).encode('ascii'))
+        return unicode_('text %s') % index
+
+    def _typed(self, column, index):
+        if column.column_name == 'test_int':
+            return index * 1000 - 1
+        if column.column_name == 'test_nan':
+            return Decimal('NaN')
+        if column.column_name == 'test_special':
+            return Decimal(('-NaN', 'Infinity', '-Infinity', '-1.50E-3',
+                            '12E+3', '-0', '0E-2')[index % 7])
+        if column.type_name.startswith('numeric('):
+            return Decimal('1.25E+%s' % index)
+        if column.type_name == 'numeric':
+            return Decimal(index) / 4 - 1
+        if column.type_name == 'uuid':
+            return UUID(int=index * 2 ** 64 + index)
+        if column.type_name == 'bytea':
+            return ('bytes %s' % index).encode('ascii')
+        return unicode_('text %s') % index
+
     def execute(self, quals, columns, sortkeys=None):
         sortkeys = sortkeys or []
-        log_to_postgres(str(sorted(quals)))
+        log_to_postgres(str(sorted(quals, key=str)))
         log_to_postgres(str(sorted(columns)))
         if (len(sortkeys)) > 0:
             log_to_postgres("requested sort(s): ")
             for k in sortkeys:
                 log_to_postgres(k)
+        if self.test_subtype == 'keep_quals':
+            log_to_postgres("KEPT QUALS: %s" % self._kept_quals)
+            self._kept_quals.extend(quals)
         if self.test_type == 'None':
             return None
         elif self.test_type == 'iter_none':
@@ -107,8 +240,24 @@ class TestForeignDataWrapper(ForeignDataWrapper):
     def get_rel_size(self, quals, columns):
         if self.test_type == 'planner':
             return (10000000, len(columns) * 10)
+        if self.exact_quals:
+            return (min([20] + [qual.value_count
+                                for qual in self.get_exact_quals(quals)
+                                if qual.value_count is not None]),
+                    len(columns) * 10)
         return (20, len(columns) * 10)
 
+    def get_exact_quals(self, quals):
+        if self.exact_quals:
+            exact = [qual for qual in quals
+                     if isinstance(qual, Qual) and
+                     qual.operator in ('=', ('=', True))]
+            if self.copy_exact_quals:
+                return [Qual(qual.field_name, qual.operator, qual.value)
+                        for qual in exact]
+            return exact
+        return []
+
     def get_path_keys(self):
         if self.test_type == 'planner':
             return [(('test1',), 1)]
@@ -136,6 +285,17 @@ class TestForeignDataWrapper(ForeignDataWrapper):
     def insert(self, values):
         if self.test_type == 'nowrite':
             super(TestForeignDataWrapper, self).insert(values)
+        if self.lazy_rows:
+            log_to_postgres("LAZY ROW: %s, %r" % (values.get('test1'), values))
+            if self.test_subtype == 'compare_rows':
+                log_to_postgres("MAPPING: %s, EQUAL: %s, DIFFERENT: %s" % (
+                    isinstance(values, Mapping), values == dict(values),
+                    values != {'test1': None}))
+            if self.test_subtype == 'keep_rows':
+                for row in self._kept_rows:
+                    log_to_postgres("KEPT ROW: %s" % sorted(row.items()))
+                self._kept_rows.append(values)
+                return
         log_to_postgres("INSERTING: %s" % sorted(values.items()))
         if self.test_type == 'returning':
             for key in self.columns:
@@ -20,6 +20,7 @@
 #include "access/sysattr.h"
 #include "access/xact.h"
 #include "nodes/makefuncs.h"
+#include "catalog/pg_attribute.h"
 #include "catalog/pg_type.h"
 #include "utils/memutils.h"
 #include "miscadmin.h"
@@ -27,6 +28,7 @@
 #include "utils/rel.h"
 #include "parser/parsetree.h"
 #include "fmgr.h"
+#include "utils/guc.h"
 
 #if PG_VERSION_NUM < 100000
 #include "executor/spi.h"
@@ -70,6 +72,7 @@ static ForeignScan *multicornGetForeignPlan(PlannerInfo *root,
 static void multicornExplainForeignScan(ForeignScanState *node, ExplainState *es);
 static void multicornBeginForeignScan(ForeignScanState *node, int eflags);
 static TupleTableSlot *multicornIterateForeignScan(ForeignScanState *node);
+static TupleTableSlot *multicornIterateForeignScanReal(ForeignScanState *node);
 static void multicornReScanForeignScan(ForeignScanState *node);
 static void multicornEndForeignScan(ForeignScanState *node);
 
@@ -108,14 +111,43 @@ static List *multicornImportForeignSchema(ImportForeignSchemaStmt * stmt,
 static void multicorn_xact_callback(XactEvent event, void *arg);
 
 /*	Helpers functions */
+static void multicorn_init_trampoline(void);
+static void multicorn_bind_trampoline(void);
+static int	getIntegerOption(Oid foreigntableid, const char *name,
+				 int default_value);
+static void multicornFetchBatch(ForeignScanState *node);
+static TupleTableSlot *multicornNextBatchRow(MulticornExecState *execstate,
+					  TupleTableSlot *slot);
 void	   *serializePlanState(MulticornPlanState * planstate);
 MulticornExecState *initializeExecState(void *internal_plan_state);
 
 /* Hash table mapping oid to fdw instances */
 HTAB	   *InstancesHash;
 
+/*
+ * Entries of InstancesHash whose instance has begun the current transaction,
+ * so that transaction callbacks only visit those.
+ */
+CacheEntry *XactInstances = NULL;
+
 PGFunction multicorn_plpython_inline_handler = NULL;
 
+/* multicorn.execution_mode GUC */
+static int	multicorn_execution_mode = MULTICORN_EXECUTION_AUTO;
+
+static const struct config_enum_entry execution_mode_options[] = {
+	{"auto", MULTICORN_EXECUTION_AUTO, false},
+	{"plpython", MULTICORN_EXECUTION_PLPYTHON, false},
+	{"direct", MULTICORN_EXECUTION_DIRECT, false},
+	{NULL, 0, false}
+};
+
+/*
+ * The inline block used to get back into C through plpython.
+ * It is built once, and reused for every trampoline call.
+ */
+static InlineCodeBlock *trampoline_codeblock = NULL;
+
 /* We need to grab a copy of this right away
    so we can handle OOM errors */
 PyObject   *tracebackModule = NULL;
@@ -145,31 +177,93 @@ multicorn_init()
 	multicorn_plpython_inline_handler  = load_external_function(plpython_module,
 								    inline_function_name,
 								    true, NULL);
+	/*
+	 * Build the trampoline block before anything can raise, so that it
+	 * exists whenever the inline handler does.
+	 */
+	multicorn_init_trampoline();
 	/* Do nothing, but let plpython init everything */
 	multicorn_call_plpython("pass");
 	}
 	PG_CATCH();
 	{
+		multicorn_plpython_inline_handler = NULL;
 		ereport(INFO, (errmsg("%s", "Unable to find plpython."), errhint("Install plpython if you wish to use plpy functions from multicorn")));
 		Py_Initialize();
 	}
 	PG_END_TRY();
 
+	if (multicorn_plpython_inline_handler != NULL)
+	{
+		multicorn_bind_trampoline();
+	}
+
 	/* load traceback now so oom problems are not quite as bad. */
 	tracebackModule = PyImport_ImportModule("traceback");	
 	errorCheck();
 }
 
+/*
+ * Prepare the inline block used by the trampoline.
+ *
+ * This only allocates the block, with a source importing the trampoline,
+ * so that it can be done before python is initialized.
+ */
+static void
+multicorn_init_trampoline(void)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
 
-void
-multicorn_call_plpython(const char *python_script)
+	trampoline_codeblock = multicorn_make_codeblock(
+		"from multicorn.utils import trampoline; trampoline()");
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Shorten the source of the trampoline block, once python is initialized.
+ *
+ * plpython compiles the source of every inline block it runs, so we
+ * want that source to be as small as possible. The trampoline callable
+ * is bound once in the __main__ namespace, which plpython copies as the
+ * globals of every inline block, so that re-entering C only costs a
+ * single call instead of an import and an attribute lookup.
+ */
+static void
+multicorn_bind_trampoline(void)
 {
-	InlineCodeBlock *codeblock = makeNode(InlineCodeBlock);
-	multicorn_init();
-	if (multicorn_plpython_inline_handler == NULL)
+	PyObject   *p_main = PyImport_AddModule("__main__"),
+			   *p_utils = PyImport_ImportModule("multicorn.utils"),
+			   *p_trampoline = NULL;
+
+	if (p_utils != NULL)
 	{
-		ereport(ERROR, (errmsg("%s", "No plpython_inline_handler avaiable"), errhint("%s", "Install plpython")));
+		p_trampoline = PyObject_GetAttrString(p_utils, "_plpy_trampoline");
 	}
+	if (p_main != NULL && p_trampoline != NULL &&
+		PyObject_SetAttrString(p_main, "_multicorn_trampoline",
+							   p_trampoline) == 0)
+	{
+		char	   *old_source = trampoline_codeblock->source_text;
+
+		trampoline_codeblock->source_text =
+			MemoryContextStrdup(TopMemoryContext, "_multicorn_trampoline()");
+		pfree(old_source);
+	}
+	/* Keep the import version if anything went wrong. */
+	PyErr_Clear();
+	Py_XDECREF(p_trampoline);
+	Py_XDECREF(p_utils);
+}
+
+
+/*
+ * Build an inline code block for plpython, in the
+ * current memory context.
+ */
+InlineCodeBlock *
+multicorn_make_codeblock(const char *python_script)
+{
+	InlineCodeBlock *codeblock = makeNode(InlineCodeBlock);
 
 	/* We need a copy of the python script, so it's not
 	 * const, and so plpython is free to free it or not. 
@@ -181,7 +275,23 @@ multicorn_call_plpython(const char *python_script)
 #if PG_VERSION_NUM >= 110000
 	codeblock->atomic = true;
 #endif
+	return codeblock;
+}
+
+void
+multicorn_call_plpython(const char *python_script)
+{
+	multicorn_init();
+	if (multicorn_plpython_inline_handler == NULL)
+	{
+		ereport(ERROR, (errmsg("%s", "No plpython_inline_handler avaiable"), errhint("%s", "Install plpython")));
+	}
+	multicorn_call_codeblock(multicorn_make_codeblock(python_script));
+}
 
+void
+multicorn_call_codeblock(InlineCodeBlock *codeblock)
+{
 	/* Version 9.6 and earlier we need to
 	 * do an SPI_push/pop so we can do an
 	 * SPI_connect.
@@ -205,147 +315,99 @@ void
 multicornCallTrampoline(TrampolineData *td)
 {
 	Assert(multicorn_trampoline_data == NULL);
+	if (trampoline_codeblock == NULL)
+	{
+		ereport(ERROR, (errmsg("%s", "The multicorn trampoline is not initialized")));
+	}
 	/* We could be really carefull with MemoryContexts,
 	 * or we could be lazy and just switch back
 	 * and forth.
 	 */
 	td->target_context = CurrentMemoryContext;
 	multicorn_trampoline_data = td;
-	multicorn_call_plpython("from multicorn.utils import trampoline; trampoline()");
+	multicorn_call_codeblock(trampoline_codeblock);
 }
 
-/* Call an instance by oid
- * without any arguments or
- * return values.
- *
- * Useful to bypass 
- * the trampoline.
- * Could use it with arguments
- * so lon as we can convert them 
- * back and forth to strings easily.
- *
- * entry is used if available
- * and we are not going through
- * plpython.  Set it to NULL
- * if it's not readily
- * available and we will look
- * it up.
+/*
+ * Decide whether a callback should go through plpython, according to
+ * multicorn.execution_mode.  This also makes sure python is initialized.
  *
+ * When plpython is required but missing, report it at the given level and
+ * call python directly if that returns.
  */
-#if PY_MAJOR_VERSION >= 3 
-#define PY_LONG_CHAR ' '
-#else
-#define PY_LONG_CHAR 'L'
-#endif
-
-static void
-multicornCallInstanceByOid(Oid ftable_oid, CacheEntry *entry, char *method)
-{	
-	char *buff;
-	size_t buff_len;
-	PyObject *result=NULL;
-
+static bool
+multicornUseTrampolineReport(int elevel)
+{
 	multicorn_init();
-	if (multicorn_plpython_inline_handler == NULL)
+	switch (multicorn_execution_mode)
 	{
-		/* call directly. */
-		if (entry == NULL)
-		{
-			bool found = false;
-			entry = hash_search(InstancesHash,
-					    &ftable_oid,
-					    HASH_FIND,
-					    &found);
-			if (!found || entry == NULL || entry->value == NULL)
+		case MULTICORN_EXECUTION_DIRECT:
+			return false;
+		case MULTICORN_EXECUTION_PLPYTHON:
+			if (multicorn_plpython_inline_handler == NULL)
 			{
-				ereport(ERROR, (errmsg("%s", "Multicorn Table OID not found")));
-				
+				ereport(elevel, (errmsg("%s", "multicorn.execution_mode is plpython, but plpython is not available"),
+								 errhint("%s", "Install plpython, or set multicorn.execution_mode to auto or direct")));
+				return false;
 			}
-		}
-		result = PyObject_CallMethod(entry->value, method, "()");
-		if (result != NULL)
-		{
-			Py_DECREF(result);
-		}
-		return;
+			return true;
+		default:
+			return multicorn_plpython_inline_handler != NULL;
 	}
+}
 
-	/* Macros are the easiest way to make this constant and easy to change. */
-#define PYTHON_TEMPLATE  "from multicorn.utils import getInstanceByOid as gio; gio(%u%c).%s()"
-#define PYTHON_TEMPLATE_LEN sizeof(PYTHON_TEMPLATE)
-
-	/* +14 allows for the oid and a little bit of extra. */
-	buff_len = strlen(method) + PYTHON_TEMPLATE_LEN + 14;
-	buff = (char *)alloca(buff_len); /* it's on the stack. no need to free.*/
-	
-	snprintf (buff, buff_len, PYTHON_TEMPLATE, ftable_oid, PY_LONG_CHAR, method);
-#undef PYTHON_TEMPLATE
-#undef PYTHON_TEMPLAET_LENGTH
+bool
+multicornUseTrampoline(void)
+{
+	return multicornUseTrampolineReport(ERROR);
+}
 
-	multicorn_call_plpython(buff);
+/*
+ * Same as multicornUseTrampoline, for transaction callbacks and the hooks
+ * they reach, where raising an error while aborting would escalate.
+ */
+static bool
+multicornUseTrampolineInCallback(void)
+{
+	return multicornUseTrampolineReport(WARNING);
+}
 
-	return;
+/*
+ * Call a lifecycle hook on the instance cached for a foreign table.
+ */
+static void
+multicornCallHookReal(CacheEntry *entry, MulticornHook hook)
+{
+	callInstanceHook(entry, hook, 0);
+	errorCheck();
 }
 
 /*
- * Process 1 integer argument
- * through to a python method.
- * We could build a generic one,
- " but we would have to
- * be able to turn everything
- * into a string, and the fallback
- * method would be difficult to code
- * without abusing the C calling
- * convention and risking
- * some portability issues.
+ * Check if we should use trampoline
  */
 static void
-multicornCallInstanceByOidInt(Oid ftable_oid, CacheEntry *entry, char *method,  int arg)
+multicornCallHookByOid(Oid ftable_oid, MulticornHook hook)
 {
-	char *buff;
-	size_t buff_len;
-	PyObject *result=NULL;
-	
-	multicorn_init();
-	if (multicorn_plpython_inline_handler == NULL)
+	CacheEntry *entry = hash_search(InstancesHash, &ftable_oid, HASH_FIND,
+									NULL);
+
+	if (entry == NULL || entry->value == NULL)
 	{
-		/* call directly. */
-		if (entry == NULL)
-		{
-			bool found = false;
-			entry = hash_search(InstancesHash,
-					    &ftable_oid,
-					    HASH_FIND,
-					    &found);
-			if (!found || entry == NULL || entry->value == NULL)
-			{
-				ereport(ERROR, (errmsg("%s", "Multicorn Table OID not found")));
-				
-			}
-		}
-		result = PyObject_CallMethod(entry->value, method, "(i)", arg);
-		if (result != NULL)
-		{
-			Py_DecRef(result);
-		}
+		ereport(ERROR, (errmsg("%s", "Multicorn Table OID not found")));
+	}
+	if (multicornUseTrampolineInCallback()) {
+		TrampolineData td;
+		td.func = (TrampolineFunc)multicornCallHookReal;
+		td.return_data = NULL;
+		td.args[0] = (void *)entry;
+		td.args[1] = (void *)(unsigned long)hook;
+		td.args[2] = NULL;
+		td.args[3] = NULL;
+		td.args[4] = NULL;
+		multicornCallTrampoline(&td);
 		return;
 	}
-
-/* Macros are the easiest way to make this constant and easy to change. */
-#define PYTHON_TEMPLATE  "from multicorn.utils import getInstanceByOid as gio; gio(%u%c).%s(%d)"
-#define PYTHON_TEMPLATE_LEN sizeof(PYTHON_TEMPLATE)
-
-	/* +28 allows for the oid, the integer and a little bit of extra. */
-	buff_len = strlen(method) + PYTHON_TEMPLATE_LEN + 28;
-	buff = (char *)alloca(buff_len); /* it's on the stack. no need to free.*/
-	
-	snprintf (buff, buff_len, PYTHON_TEMPLATE, ftable_oid, PY_LONG_CHAR, method, arg);
-#undef PYTHON_TEMPLATE
-#undef PYTHON_TEMPLAET_LENGTH
-
-	multicorn_call_plpython(buff);
-
-	return;
+	multicornCallHookReal(entry, hook);
 }
 
 void
@@ -359,6 +421,21 @@ _PG_init()
 	 * just call plpython if it's available.
 	 */
 	
+	DefineCustomEnumVariable("multicorn.execution_mode",
+							 "Selects how multicorn calls into python.",
+							 "auto goes through plpython when it is available, "
+							 "plpython always does, and direct calls the python "
+							 "interpreter without plpython, which is faster but "
+							 "prevents using plpy from the foreign data wrappers.",
+							 &multicorn_execution_mode,
+							 MULTICORN_EXECUTION_AUTO,
+							 execution_mode_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	RegisterXactCallback(multicorn_xact_callback, NULL);
 #if PG_VERSION_NUM >= 90300
 	RegisterSubXactCallback(multicorn_subxact_callback, NULL);
@@ -452,6 +529,41 @@ multicorn_validator_real(PG_FUNCTION_ARGS)
 				className = (char *) defGetString(def);
 			}
 		}
+		else if (strcmp(def->defname, "fetch_size") == 0)
+		{
+			char	   *value = defGetString(def);
+			char	   *endptr;
+			long		fetch_size = strtol(value, &endptr, 10);
+
+			/* Only read from the table, or else the server */
+			if (catalog != ForeignTableRelationId &&
+				catalog != ForeignServerRelationId)
+			{
+				ereport(ERROR, (errmsg("%s", "Cannot set fetch_size here"),
+								errhint("%s", "Set it on the server or on the table")));
+			}
+			if (*value == '\0' || *endptr != '\0' ||
+				fetch_size <= 0 || fetch_size > INT_MAX)
+			{
+				ereport(ERROR, (errmsg("%s", "fetch_size requires a positive integer value")));
+			}
+		}
+		else if (strcmp(def->defname, "numeric_as") == 0)
+		{
+			char	   *value = defGetString(def);
+
+			/* Only read from the table and its columns */
+			if (catalog != ForeignTableRelationId &&
+				catalog != AttributeRelationId)
+			{
+				ereport(ERROR, (errmsg("%s", "Cannot set numeric_as here"),
+								errhint("%s", "Set it on the table or on a column")));
+			}
+			if (strcmp(value, "decimal") != 0 && strcmp(value, "float") != 0)
+			{
+				ereport(ERROR, (errmsg("%s", "numeric_as must be either decimal or float")));
+			}
+		}
 	}
 	if (catalog == ForeignServerRelationId)
 	{
@@ -471,8 +583,7 @@ multicorn_validator_real(PG_FUNCTION_ARGS)
 Datum
 multicorn_validator(PG_FUNCTION_ARGS)
 {
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
+	if (multicornUseTrampoline()) {
 		TrampolineData td;
 		td.func = (TrampolineFunc)multicorn_validator_real;
 		td.return_data = NULL;
@@ -502,6 +613,7 @@ multicornGetForeignRelSizeReal(PlannerInfo *root,
 	ListCell   *lc;
 	bool		needWholeRow = false;
 	TupleDesc	desc;
+	List	   *vars;
 	
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
 	
@@ -520,9 +632,25 @@ multicornGetForeignRelSizeReal(PlannerInfo *root,
 		planstate->cinfos = palloc0(sizeof(ConversionInfo *) *
 									planstate->numattrs);
 		initConversioninfo(planstate->cinfos, attinmeta);
+		initNumericConversion(planstate->cinfos, planstate->numattrs,
+							  foreigntableid);
 		needWholeRow = rel->trigdesc && rel->trigdesc->trig_insert_after_row;
 		RelationClose(rel);
 	}
+	/* Pull "var" clauses to build an appropriate target list */
+#if PG_VERSION_NUM >= 90600
+	vars = extractColumns(baserel->reltarget->exprs, baserel->baserestrictinfo);
+#else
+	vars = extractColumns(baserel->reltargetlist, baserel->baserestrictinfo);
+#endif
+	/* A whole-row reference needs every column. */
+	foreach(lc, vars)
+	{
+		if (((Var *) lfirst(lc))->varattno == 0)
+		{
+			needWholeRow = true;
+		}
+	}
 	if (needWholeRow)
 	{
 		int			i;
@@ -539,12 +667,7 @@ multicornGetForeignRelSizeReal(PlannerInfo *root,
 	}
 	else
 	{
-		/* Pull "var" clauses to build an appropriate target list */
-#if PG_VERSION_NUM >= 90600
-		foreach(lc, extractColumns(baserel->reltarget->exprs, baserel->baserestrictinfo))
-#else
-		foreach(lc, extractColumns(baserel->reltargetlist, baserel->baserestrictinfo))
-#endif
+		foreach(lc, vars)
 		{
 			Var		   *var = (Var *) lfirst(lc);
 			Value	   *colname;
@@ -563,9 +686,14 @@ multicornGetForeignRelSizeReal(PlannerInfo *root,
 	/* Extract the restrictions from the plan. */
 	foreach(lc, baserel->baserestrictinfo)
 	{
-		extractRestrictions(baserel->relids, ((RestrictInfo *) lfirst(lc))->clause,
-							&planstate->qual_list);
+		Expr	   *clause = ((RestrictInfo *) lfirst(lc))->clause;
+		int			nquals = list_length(planstate->qual_list);
 
+		extractRestrictions(baserel->relids, clause, &planstate->qual_list);
+		if (list_length(planstate->qual_list) > nquals)
+		{
+			planstate->qual_clauses = lappend(planstate->qual_clauses, clause);
+		}
 	}
 	/* Inject the "rows" and "width" attribute into the baserel */
 #if PG_VERSION_NUM >= 90600
@@ -574,6 +702,7 @@ multicornGetForeignRelSizeReal(PlannerInfo *root,
 #else
 	getRelSize(planstate, root, &baserel->rows, &baserel->width);
 #endif
+	planstate->exact_clauses = getExactClauses(planstate);
 }
 /* Trampoline Version */
 static void
@@ -581,8 +710,7 @@ multicornGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel,  Oid foreignt
 {
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
 	
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
+	if (multicornUseTrampoline()) {
 		TrampolineData td;
 		td.func = (TrampolineFunc)multicornGetForeignRelSizeReal;
 		td.return_data = NULL;
@@ -694,8 +822,7 @@ static void
 multicornGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
 {
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
+	if (multicornUseTrampoline()) {
 		TrampolineData td;
 		td.func = (TrampolineFunc)multicornGetForeignPathsReal;
 		td.return_data = NULL;
@@ -735,6 +862,10 @@ multicornGetForeignPlan(PlannerInfo *root,
 	Index		scan_relid = baserel->relid;
 	MulticornPlanState *planstate = (MulticornPlanState *) baserel->fdw_private;
 	ListCell   *lc;
+	List	   *local_clauses = NIL;
+#if PG_VERSION_NUM >= 90500
+	List	   *recheck_clauses = NIL;
+#endif
 	
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
 	
@@ -753,14 +884,34 @@ multicornGetForeignPlan(PlannerInfo *root,
 		}
 	}
 	planstate->pathkeys = (List *) best_path->fdw_private;
+#if PG_VERSION_NUM >= 90500
+	/*
+	 * The clauses enforced by the fdw are not checked again on every row,
+	 * only by EvalPlanQual, which does not go through the fdw.
+	 */
+	foreach(lc, scan_clauses)
+	{
+		if (list_member_ptr(planstate->exact_clauses, lfirst(lc)))
+		{
+			recheck_clauses = lappend(recheck_clauses, lfirst(lc));
+		}
+		else
+		{
+			local_clauses = lappend(local_clauses, lfirst(lc));
+		}
+	}
+#else
+	/* Without fdw_recheck_quals, every clause has to be checked locally. */
+	local_clauses = scan_clauses;
+#endif
 	return make_foreignscan(tlist,
-							scan_clauses,
+							local_clauses,
 							scan_relid,
 							scan_clauses,		/* no expressions to evaluate */
 							serializePlanState(planstate)
 #if PG_VERSION_NUM >= 90500
 							, NULL
-							, NULL /* All quals are meant to be rechecked */
+							, recheck_clauses
 							, NULL
 #endif
 							);
@@ -797,8 +948,7 @@ multicornExplainForeignScanReal(ForeignScanState *node, ExplainState *es)
 void
 multicornExplainForeignScan(ForeignScanState *node, ExplainState *es)
 {
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
+	if (multicornUseTrampoline()) {
 		TrampolineData td;
 		td.func = (TrampolineFunc)multicornExplainForeignScanReal;
 		td.return_data = NULL;
@@ -843,6 +993,41 @@ multicornBeginForeignScanReal(ForeignScanState *node, int eflags)
 							&execstate->qual_list);
 	}
 	initConversioninfo(execstate->cinfos, TupleDescGetAttInMetadata(tupdesc));
+	initNumericConversion(execstate->cinfos, tupdesc->natts,
+						  execstate->ftable_oid);
+	initColumnKeys(execstate->cinfos, tupdesc->natts, execstate->target_list);
+	initProjection(execstate, tupdesc->natts);
+	initQuals(execstate, node);
+	/*
+	 * The trampoline used for every row only depends on the node,
+	 * so set it up once for the whole scan.
+	 */
+	execstate->iterate_td.func = (TrampolineFunc)multicornIterateForeignScanReal;
+	execstate->iterate_td.return_data = NULL;
+	execstate->iterate_td.args[0] = (void *)node;
+	execstate->iterate_td.args[1] = NULL;
+	execstate->iterate_td.args[2] = NULL;
+	execstate->iterate_td.args[3] = NULL;
+	execstate->iterate_td.args[4] = NULL;
+	/*
+	 * When fetching several rows at a time, each one gets its own slice of
+	 * the values and nulls arrays, and their datums live in a context which
+	 * is reset before every refill.
+	 */
+	execstate->fetch_size = getIntegerOption(execstate->ftable_oid,
+											 "fetch_size", 1);
+	if (execstate->fetch_size > 1)
+	{
+		execstate->batch_values = palloc(sizeof(Datum) * tupdesc->natts *
+										 execstate->fetch_size);
+		execstate->batch_nulls = palloc(sizeof(bool) * tupdesc->natts *
+										execstate->fetch_size);
+		execstate->batch_context = AllocSetContextCreate(CurrentMemoryContext,
+													 "multicorn fetch batch",
+													 ALLOCSET_DEFAULT_MINSIZE,
+													 ALLOCSET_DEFAULT_INITSIZE,
+													 ALLOCSET_DEFAULT_MAXSIZE);
+	}
 	node->fdw_state = execstate;
 }
 
@@ -852,8 +1037,7 @@ multicornBeginForeignScanReal(ForeignScanState *node, int eflags)
 static void
 multicornBeginForeignScan(ForeignScanState *node, int eflags)
 {
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
+	if (multicornUseTrampoline()) {
 		TrampolineData td;
 		td.func = (TrampolineFunc)multicornBeginForeignScanReal;
 		td.return_data = NULL;
@@ -899,6 +1083,11 @@ multicornIterateForeignScanReal(ForeignScanState *node)
 		Py_DECREF(execstate->p_iterator);
 		return slot;
 	}
+	if (execstate->fetch_size > 1)
+	{
+		multicornFetchBatch(node);
+		return multicornNextBatchRow(execstate, slot);
+	}
 	p_value = PyIter_Next(execstate->p_iterator);
 	errorCheck();
 	/* A none value results in an empty slot. */
@@ -909,31 +1098,92 @@ multicornIterateForeignScanReal(ForeignScanState *node)
 	}
 	slot->tts_values = execstate->values;
 	slot->tts_isnull = execstate->nulls;
-	pythonResultToTuple(p_value, slot, execstate->cinfos, execstate->buffer);
+	pythonScanResultToTuple(p_value, slot, execstate);
 	ExecStoreVirtualTuple(slot);
 	Py_DECREF(p_value);
 
 	return slot;
 }
 
+/*
+ * Fetch up to fetch_size rows from the python iterator, converting each of
+ * them to its own slice of the batch arrays.
+ */
+static void
+multicornFetchBatch(ForeignScanState *node)
+{
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	MulticornExecState *execstate = node->fdw_state;
+	int			natts = slot->tts_tupleDescriptor->natts;
+	MemoryContext oldcontext;
+	PyObject   *p_value;
+
+	MemoryContextReset(execstate->batch_context);
+	execstate->batch_len = 0;
+	execstate->batch_pos = 0;
+	oldcontext = MemoryContextSwitchTo(execstate->batch_context);
+	while (execstate->batch_len < execstate->fetch_size)
+	{
+		p_value = PyIter_Next(execstate->p_iterator);
+		/* A none value, or the end of the iterator, ends the scan. */
+		if (p_value == NULL || p_value == Py_None)
+		{
+			Py_XDECREF(p_value);
+			execstate->batch_done = true;
+			break;
+		}
+		slot->tts_values = execstate->batch_values + execstate->batch_len * natts;
+		slot->tts_isnull = execstate->batch_nulls + execstate->batch_len * natts;
+		pythonScanResultToTuple(p_value, slot, execstate);
+		Py_DECREF(p_value);
+		execstate->batch_len++;
+	}
+	MemoryContextSwitchTo(oldcontext);
+	errorCheck();
+}
+
+/*
+ * Store the next fetched row in the slot, or leave it empty if the
+ * batch is exhausted.
+ */
+static TupleTableSlot *
+multicornNextBatchRow(MulticornExecState *execstate, TupleTableSlot *slot)
+{
+	int			natts = slot->tts_tupleDescriptor->natts;
+
+	ExecClearTuple(slot);
+	if (execstate->batch_pos < execstate->batch_len)
+	{
+		slot->tts_values = execstate->batch_values + execstate->batch_pos * natts;
+		slot->tts_isnull = execstate->batch_nulls + execstate->batch_pos * natts;
+		execstate->batch_pos++;
+		ExecStoreVirtualTuple(slot);
+	}
+	return slot;
+}
+
 /*
  * Check if we should use trampoline
  */
 static TupleTableSlot *
 multicornIterateForeignScan(ForeignScanState *node)
 {
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
-		TrampolineData td;
-		td.func = (TrampolineFunc)multicornIterateForeignScanReal;
-		td.return_data = NULL;
-		td.args[0] = (void *)node;
-		td.args[1] = NULL;
-		td.args[2] = NULL;
-		td.args[3] = NULL;
-		td.args[4] = NULL;
-		multicornCallTrampoline(&td);
-		return (TupleTableSlot *)td.return_data;
+	MulticornExecState *execstate = node->fdw_state;
+
+	/*
+	 * Rows already fetched, and the end of the scan, are served without
+	 * going back to python.
+	 */
+	if (execstate->batch_pos < execstate->batch_len || execstate->batch_done)
+	{
+		return multicornNextBatchRow(execstate, node->ss.ss_ScanTupleSlot);
+	}
+	if (multicornUseTrampoline()) {
+		/* Reuse the trampoline prepared in BeginForeignScan */
+		TrampolineData *td = &execstate->iterate_td;
+		td->return_data = NULL;
+		multicornCallTrampoline(td);
+		return (TupleTableSlot *)td->return_data;
 	}
 	return multicornIterateForeignScanReal(node);
 }
@@ -959,6 +1209,9 @@ multicornReScanForeignScan(ForeignScanState *node)
 		Py_DECREF(state->p_iterator);
 		state->p_iterator = NULL;
 	}
+	state->batch_len = 0;
+	state->batch_pos = 0;
+	state->batch_done = false;
 }
 
 /*
@@ -975,14 +1228,11 @@ multicornEndForeignScan(ForeignScanState *node)
 	MulticornExecState *state = node->fdw_state;
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
 	
-	multicornCallInstanceByOid(state->ftable_oid,
-				   NULL,
-				   "end_modify");
-
-	errorCheck();
+	multicornCallHookByOid(state->ftable_oid, MULTICORN_HOOK_END_MODIFY);
 	Py_DECREF(state->fdw_instance);
 	Py_XDECREF(state->p_iterator);
 	state->p_iterator = NULL;
+	freeQuals(state);
 
 
 	/* Free this up so that
@@ -992,7 +1242,21 @@ multicornEndForeignScan(ForeignScanState *node)
 	 */
 	pfree(state->values);
 	pfree(state->nulls);
+	freeColumnKeys(state->cinfos,
+				   RelationGetDescr(node->ss.ss_currentRelation)->natts);
 	pfree(state->cinfos);
+	if (state->projection != NULL)
+	{
+		pfree(state->projection);
+		state->projection = NULL;
+	}
+	if (state->batch_context != NULL)
+	{
+		MemoryContextDelete(state->batch_context);
+		pfree(state->batch_values);
+		pfree(state->batch_nulls);
+		state->batch_context = NULL;
+	}
 
 	state->values = NULL;
 	state->nulls = NULL;
@@ -1070,8 +1334,7 @@ multicornAddForeignUpdateTargets(Query *parsetree,
 
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
 	
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
+	if (multicornUseTrampoline()) {
 		TrampolineData td;
 		td.func = (TrampolineFunc)multicornAddForeignUpdateTargetsReal;
 		td.return_data = NULL;
@@ -1132,6 +1395,8 @@ multicornBeginForeignModifyReal(ModifyTableState *mtstate,
 	modstate->fdw_instance = getInstance(rel->rd_id);
 	modstate->rowidAttrName = getRowIdColumn(modstate->fdw_instance);
 	initConversioninfo(modstate->cinfos, TupleDescGetAttInMetadata(desc));
+	initNumericConversion(modstate->cinfos, desc->natts, rel->rd_id);
+	initRowMapping(modstate, desc->natts);
 	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
 	MemoryContextSwitchTo(oldcontext);
 	if (ps->ps_ResultTupleSlot)
@@ -1169,8 +1434,7 @@ multicornBeginForeignModify(ModifyTableState *mtstate,
 	
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
 
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
+	if (multicornUseTrampoline()) {
 		TrampolineData td;
 		td.func = (TrampolineFunc)multicornBeginForeignModifyReal;
 		td.return_data = NULL;
@@ -1197,8 +1461,7 @@ funcname(EState *estate, ResultRelInfo *resultRelInfo,			\
 	 TupleTableSlot *slot, TupleTableSlot *planSlot)		\
 {									\
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__))); \
-	multicorn_init();						\
-	if (multicorn_plpython_inline_handler != NULL)			\
+	if (multicornUseTrampoline())					\
 	{								\
 		TrampolineData td;					\
 		td.func = (TrampolineFunc)funcname##Real;		\
@@ -1229,11 +1492,17 @@ multicornExecForeignInsertReal(EState *estate, ResultRelInfo *resultRelInfo,
 {
 	MulticornModifyState *modstate = resultRelInfo->ri_FdwState;
 	PyObject   *fdw_instance = modstate->fdw_instance;
-	PyObject   *values = tupleTableSlotToPyObject(slot, modstate->cinfos);
+	PyObject   *values = modstate->rowNames != NULL ?
+		slotToRowMapping(slot, modstate) :
+		tupleTableSlotToPyObject(slot, modstate->cinfos);
 	PyObject   *p_new_value = PyObject_CallMethod(fdw_instance, "insert", "(O)", values);
 
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
 	
+	if (modstate->rowNames != NULL)
+	{
+		detachRowMapping(values);
+	}
 	errorCheck();
 	if (p_new_value && p_new_value != Py_None)
 	{
@@ -1301,7 +1570,9 @@ multicornExecForeignUpdateReal(EState *estate, ResultRelInfo *resultRelInfo,
 	PyObject   *fdw_instance = modstate->fdw_instance,
 			   *p_row_id,
 			   *p_new_value,
-			   *p_value = tupleTableSlotToPyObject(slot, modstate->cinfos);
+			   *p_value = modstate->rowNames != NULL ?
+		slotToRowMapping(slot, modstate) :
+		tupleTableSlotToPyObject(slot, modstate->cinfos);
 	bool		is_null;
 	ConversionInfo *cinfo = modstate->rowidCinfo;
 	Datum		value = ExecGetJunkAttribute(planSlot, modstate->rowidAttno, &is_null);
@@ -1311,6 +1582,10 @@ multicornExecForeignUpdateReal(EState *estate, ResultRelInfo *resultRelInfo,
 	p_row_id = datumToPython(value, cinfo->atttypoid, cinfo);
 	p_new_value = PyObject_CallMethod(fdw_instance, "update", "(O,O)", p_row_id,
 									  p_value);
+	if (modstate->rowNames != NULL)
+	{
+		detachRowMapping(p_value);
+	}
 	errorCheck();
 	if (p_new_value != NULL && p_new_value != Py_None)
 	{
@@ -1320,6 +1595,7 @@ multicornExecForeignUpdateReal(EState *estate, ResultRelInfo *resultRelInfo,
 	}
 	Py_XDECREF(p_new_value);
 	Py_DECREF(p_row_id);
+	Py_DECREF(p_value);
 	errorCheck();
 	return slot;
 }
@@ -1336,10 +1612,9 @@ multicornEndForeignModify(EState *estate, ResultRelInfo *resultRelInfo)
 
 {
 	MulticornModifyState *modstate = resultRelInfo->ri_FdwState;
-	multicornCallInstanceByOid(modstate->ftable_oid,
-				   NULL,
-				   "end_modify");
-	errorCheck();
+	multicornCallHookByOid(modstate->ftable_oid, MULTICORN_HOOK_END_MODIFY);
+	Py_XDECREF(modstate->rowNames);
+	Py_XDECREF(modstate->rowIndexes);
 	Py_DECREF(modstate->fdw_instance);
 }
 
@@ -1347,12 +1622,39 @@ multicornEndForeignModify(EState *estate, ResultRelInfo *resultRelInfo)
  * Callback used to propagate a subtransaction end.
  */
 static void
+multicorn_subxact_callback_real(SubXactEvent event, int curlevel)
+{
+	CacheEntry *entry;
+
+	for (entry = XactInstances; entry != NULL; entry = entry->xact_next)
+	{
+		if (entry->xact_depth < curlevel)
+			continue;
+
+		if (event == SUBXACT_EVENT_PRE_COMMIT_SUB)
+		{
+			callInstanceHook(entry, MULTICORN_HOOK_SUB_COMMIT, curlevel);
+		}
+		else
+		{
+			callInstanceHook(entry, MULTICORN_HOOK_SUB_ROLLBACK, curlevel);
+		}
+		errorCheck();
+		entry->xact_depth--;
+	}
+}
+
+/*
+ * Enter python once for the whole subtransaction event, and only if some
+ * instance actually took part in it.
+ */
+static void
 multicorn_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 						   SubTransactionId parentSubid, void *arg)
 {
 	int			curlevel;
-	HASH_SEQ_STATUS status;
 	CacheEntry *entry;
+	bool		active = false;
 
 	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
 
@@ -1362,31 +1664,30 @@ multicorn_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 
 	curlevel = GetCurrentTransactionNestLevel();
 
-	hash_seq_init(&status, InstancesHash);
-
-	while ((entry = (CacheEntry *) hash_seq_search(&status)) != NULL)
+	for (entry = XactInstances; entry != NULL; entry = entry->xact_next)
 	{
-		if (entry->xact_depth < curlevel)
-			continue;
-
-		if (event == SUBXACT_EVENT_PRE_COMMIT_SUB)
-		{
-
-			multicornCallInstanceByOidInt(entry->hashkey,
-						      entry,
-						      "sub_commit",
-						      curlevel);
-		}
-		else
+		if (entry->xact_depth >= curlevel)
 		{
-			multicornCallInstanceByOidInt(entry->hashkey,
-						      entry,
-						      "sub_rollback",
-						      curlevel);
+			active = true;
+			break;
 		}
-		errorCheck();
-		entry->xact_depth--;
 	}
+	if (!active)
+		return;
+
+	if (multicornUseTrampolineInCallback()) {
+		TrampolineData td;
+		td.func = (TrampolineFunc)multicorn_subxact_callback_real;
+		td.return_data = NULL;
+		td.args[0] = (void *)(unsigned long)event;
+		td.args[1] = (void *)(unsigned long)curlevel;
+		td.args[2] = NULL;
+		td.args[3] = NULL;
+		td.args[4] = NULL;
+		multicornCallTrampoline(&td);
+		return;
+	}
+	multicorn_subxact_callback_real(event, curlevel);
 }
 #endif
 
@@ -1394,51 +1695,110 @@ multicorn_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
  * Callback used to propagate pre-commit / commit / rollback.
  */
 static void
-multicorn_xact_callback(XactEvent event, void *arg)
+multicorn_xact_callback_real(XactEvent event)
 {
-	HASH_SEQ_STATUS status;
 	CacheEntry *entry;
 
-	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
+#if PG_VERSION_NUM >= 90300
+	if (event == XACT_EVENT_PRE_COMMIT)
+	{
+		for (entry = XactInstances; entry != NULL; entry = entry->xact_next)
+		{
+			if (entry->xact_depth == 0)
+				continue;
+			callInstanceHook(entry, MULTICORN_HOOK_PRE_COMMIT, 0);
+			errorCheck();
+		}
+		return;
+	}
+#endif
 
-	hash_seq_init(&status, InstancesHash);
-	while ((entry = (CacheEntry *) hash_seq_search(&status)) != NULL)
+	/*
+	 * The transaction ends: unlink every entry before calling its hook, so
+	 * that an error only leaves the remaining ones to be rolled back.
+	 */
+	while ((entry = XactInstances) != NULL)
 	{
+		XactInstances = entry->xact_next;
+		entry->xact_next = NULL;
+		entry->in_xact = false;
 		if (entry->xact_depth == 0)
 			continue;
 
 		switch (event)
 		{
-#if PG_VERSION_NUM >= 90300
-			case XACT_EVENT_PRE_COMMIT:
-				multicornCallInstanceByOid(entry->hashkey,
-							   entry,
-							   "pre_commit");
-				break;
-#endif
 			case XACT_EVENT_COMMIT:
-				multicornCallInstanceByOid(entry->hashkey,
-							   entry,
-							   "commit");
-				entry->xact_depth = 0;
+				callInstanceHook(entry, MULTICORN_HOOK_COMMIT, 0);
 				break;
 			case XACT_EVENT_ABORT:
 				/* XXXXX FIXME: An exception here is really bad.
 				   The process will crash.  However, that may
 				   be the best we can do.
 				*/
-				multicornCallInstanceByOid(entry->hashkey,
-							   entry,
-							   "rollback");
-				entry->xact_depth = 0;
+				callInstanceHook(entry, MULTICORN_HOOK_ROLLBACK, 0);
 				break;
 			default:
 				break;
 		}
+		entry->xact_depth = 0;
 		errorCheck();
 	}
 }
 
+/*
+ * Enter python once for the whole transaction event, and only if some
+ * instance actually took part in the transaction.
+ */
+static void
+multicorn_xact_callback(XactEvent event, void *arg)
+{
+	CacheEntry *entry;
+	bool		active = false;
+
+	ereport(DEBUG5, (errmsg("MULTICORN FILE=%s LINE=%d FUNC=%s",  __FILE__, __LINE__,__PRETTY_FUNCTION__)));
+
+	switch (event)
+	{
+#if PG_VERSION_NUM >= 90300
+		case XACT_EVENT_PRE_COMMIT:
+#endif
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+			break;
+		default:
+			return;
+	}
+
+	for (entry = XactInstances; entry != NULL; entry = entry->xact_next)
+	{
+		if (entry->xact_depth != 0)
+		{
+			active = true;
+			break;
+		}
+	}
+	if (!active)
+	{
+		/* No hook to call, this only empties the list. */
+		multicorn_xact_callback_real(event);
+		return;
+	}
+
+	if (multicornUseTrampolineInCallback()) {
+		TrampolineData td;
+		td.func = (TrampolineFunc)multicorn_xact_callback_real;
+		td.return_data = NULL;
+		td.args[0] = (void *)(unsigned long)event;
+		td.args[1] = NULL;
+		td.args[2] = NULL;
+		td.args[3] = NULL;
+		td.args[4] = NULL;
+		multicornCallTrampoline(&td);
+		return;
+	}
+	multicorn_xact_callback_real(event);
+}
+
 #if PG_VERSION_NUM >= 90500
 static List *
 multicornImportForeignSchemaReal(ImportForeignSchemaStmt * stmt,
@@ -1549,8 +1909,7 @@ static List *
 multicornImportForeignSchema(ImportForeignSchemaStmt * stmt,
 			     Oid serverOid)
 {
-	multicorn_init();
-	if (multicorn_plpython_inline_handler != NULL) {
+	if (multicornUseTrampoline()) {
 		TrampolineData td;
 		td.func = (TrampolineFunc)multicornImportForeignSchemaReal;
 		td.return_data = NULL;
@@ -1618,3 +1977,28 @@ initializeExecState(void *internalstate)
 	execstate->ftable_oid = foreigntableid;
 	return execstate;
 }
+
+/*
+ *	Returns the value of an integer option, such as the number of rows to
+ *	fetch from python at once, set on the table, or else on the server.
+ */
+static int
+getIntegerOption(Oid foreigntableid, const char *name, int default_value)
+{
+	ForeignTable *ftable = GetForeignTable(foreigntableid);
+	ForeignServer *fserver = GetForeignServer(ftable->serverid);
+	List	   *options = list_concat(list_copy(ftable->options),
+									  fserver->options);
+	ListCell   *lc;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, name) == 0)
+		{
+			return (int) strtol(defGetString(def), NULL, 10);
+		}
+	}
+	return default_value;
+}
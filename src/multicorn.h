@@ -54,6 +54,28 @@ typedef struct TrampolineData
 extern TrampolineData *multicorn_trampoline_data;
 void multicornCallTrampoline(TrampolineData *td);
 
+/* Values of the multicorn.execution_mode GUC */
+typedef enum MulticornExecutionMode
+{
+	MULTICORN_EXECUTION_AUTO,
+	MULTICORN_EXECUTION_PLPYTHON,
+	MULTICORN_EXECUTION_DIRECT
+}	MulticornExecutionMode;
+
+bool		multicornUseTrampoline(void);
+
+/* Python methods called on transaction and scan lifecycle events */
+typedef enum MulticornHook
+{
+	MULTICORN_HOOK_PRE_COMMIT,
+	MULTICORN_HOOK_COMMIT,
+	MULTICORN_HOOK_ROLLBACK,
+	MULTICORN_HOOK_SUB_COMMIT,
+	MULTICORN_HOOK_SUB_ROLLBACK,
+	MULTICORN_HOOK_END_MODIFY,
+	MULTICORN_NUM_HOOKS
+}	MulticornHook;
+
 typedef struct CacheEntry
 {
 	Oid			hashkey;
@@ -61,9 +83,24 @@ typedef struct CacheEntry
 	List	   *options;
 	List	   *columns;
 	int			xact_depth;
+	/* Bound methods for each MulticornHook, NULL if not found */
+	PyObject   *hooks[MULTICORN_NUM_HOOKS];
+	/* Link in the list of entries taking part in the current transaction */
+	struct CacheEntry *xact_next;
+	bool		in_xact;
 }	CacheEntry;
 
 
+struct ConversionInfo;
+
+/*
+ * Converts a python object to a datum of the column type, returning false
+ * if the object has to go through its text representation instead.
+ */
+typedef bool (*PyToDatumFunc) (PyObject *pyobject,
+							   struct ConversionInfo *cinfo,
+							   Datum *value);
+
 typedef struct ConversionInfo
 {
 	char	   *attrname;
@@ -76,6 +113,20 @@ typedef struct ConversionInfo
 	bool		is_array;
 	int			attndims;
 	bool		need_quote;
+	PyToDatumFunc pytodatum;
+	/* For array columns, how to convert and store the elements */
+	struct ConversionInfo *elemcinfo;
+	int16		elmlen;
+	bool		elmbyval;
+	char		elmalign;
+	/* For hstore columns, the hstore(text[], text[]) function */
+	FmgrInfo   *hstorefunc;
+	/* Key of the column in the dicts returned by a scan, see initColumnKeys */
+	PyObject   *attrkey;
+	/* Set for the columns a scan does not need, which are left NULL */
+	bool		attskip;
+	/* Pass numeric values to python as decimals, see the numeric_as option */
+	bool		numeric_as_decimal;
 }	ConversionInfo;
 
 
@@ -89,6 +140,10 @@ typedef struct MulticornPlanState
 	int			startupCost;
 	ConversionInfo **cinfos;
 	List	   *pathkeys; /* list of MulticornDeparsedSortGroup) */
+	/* Clause of each qual of qual_list, as given to get_rel_size */
+	List	   *qual_clauses;
+	/* Clauses the fdw enforces, see getExactClauses */
+	List	   *exact_clauses;
 
 	/* For some reason, `baserel->reltarget->width` gets changed
 	 * outside of our control somewhere between GetForeignPaths and
@@ -117,6 +172,34 @@ typedef struct MulticornExecState
 	char	   *rowidAttrName;
 	List	   *pathkeys; /* list of MulticornDeparsedSortGroup) */
 	Oid        ftable_oid;
+	/* Trampoline used by every IterateForeignScan call */
+	TrampolineData iterate_td;
+	/* Rows fetched ahead from python, see the fetch_size option */
+	int			fetch_size;
+	int			batch_len;
+	int			batch_pos;
+	bool		batch_done;
+	Datum	   *batch_values;
+	bool	   *batch_nulls;
+	MemoryContext batch_context;
+	/*
+	 * For fdws returning projected sequences, the attribute index of each
+	 * item of the returned sequences, see initProjection.
+	 */
+	int		   *projection;
+	int			projection_len;
+	/*
+	 * Quals given to execute, see initQuals.  Those with a constant value
+	 * are built once per scan, the others are None and built again from
+	 * dynamic_quals for every execution.
+	 */
+	PyObject   *p_quals;
+	List	   *dynamic_quals;
+	/* Their parameters, of type MulticornParamQualState */
+	List	   *param_quals;
+	/* Those whose value is the same for the whole query, see initQuals */
+	List	   *stable_quals;
+	bool		stable_quals_evaluated;
 }	MulticornExecState;
 
 typedef struct MulticornModifyState
@@ -129,6 +212,9 @@ typedef struct MulticornModifyState
 	char	   *rowidAttrName;
 	ConversionInfo *rowidCinfo;
 	Oid        ftable_oid;
+	/* Shared by the rows given to fdws with lazy_rows, see initRowMapping */
+	PyObject   *rowNames;
+	PyObject   *rowIndexes;
 }	MulticornModifyState;
 
 
@@ -159,8 +245,63 @@ typedef struct MulticornParamQual
 {
 	MulticornBaseQual base;
 	Expr	   *expr;
+	/* Set up by initQuals during a scan */
+	struct MulticornParamQualState *state;
 }	MulticornParamQual;
 
+/* An AND, OR or NOT of other quals, given to python as a BoolQual */
+typedef struct MulticornBoolQual
+{
+	MulticornBaseQual base;
+	BoolExprType boolop;
+	List	   *args;
+	/*
+	 * Set up by initQuals when some of the args hold a parameter: the python
+	 * quals of the others, and None for those in dynamic_args, built again
+	 * for every execution.
+	 */
+	PyObject   *p_args;
+	List	   *dynamic_args;
+}	MulticornBoolQual;
+
+/*
+ * An operator applied to functions of the columns, or to several columns,
+ * given to python as an ExpressionQual.
+ */
+typedef struct MulticornExprQual
+{
+	MulticornBaseQual base;
+	Expr	   *left;
+	Expr	   *right;
+	/* Whether right is evaluated by the executor, like a param qual */
+	bool		right_is_param;
+	/* Set up by initQuals during a scan, when right_is_param */
+	struct MulticornParamQualState *state;
+}	MulticornExprQual;
+
+/*
+ * A qual compared to a parameter, whose value is evaluated on every
+ * execution of the scan.
+ */
+typedef struct MulticornParamQualState
+{
+	Expr	   *expr;
+	ExprState  *expr_state;
+	Oid			typeoid;
+	/* Whether the value is an array for "column op ANY(value)" */
+	bool		isArray;
+	/* The column the parameter is compared to, if any */
+	ConversionInfo *cinfo;
+	/* The value for the current execution, released by freeQuals */
+	PyObject   *p_value;
+	/*
+	 * The left operand (the field name, or the expression of an
+	 * ExpressionQual) and the operator of the python qual, built once.
+	 */
+	PyObject   *p_left;
+	PyObject   *p_operator;
+}	MulticornParamQualState;
+
 typedef struct MulticornDeparsedSortGroup
 {
 	Name 			attname;
@@ -181,12 +322,19 @@ char	  **pyUnicodeToPgString(PyObject *pyobject);
 PyObject   *getInstance(Oid foreigntableid);
 PyObject   *qualToPyObject(Expr *expr, PlannerInfo *root);
 PyObject   *getClassString(const char *className);
+void		initQuals(MulticornExecState * state, ForeignScanState *node);
+void		freeQuals(MulticornExecState * state);
 PyObject   *execute(ForeignScanState *state, ExplainState *es);
 void pythonResultToTuple(PyObject *p_value,
 					TupleTableSlot *slot,
 					ConversionInfo ** cinfos,
 					StringInfo buffer);
 PyObject   *tupleTableSlotToPyObject(TupleTableSlot *slot, ConversionInfo ** cinfos);
+void initColumnKeys(ConversionInfo ** cinfos, int natts, List *target_list);
+void freeColumnKeys(ConversionInfo ** cinfos, int natts);
+void initProjection(MulticornExecState * state, int natts);
+void pythonScanResultToTuple(PyObject *p_value, TupleTableSlot *slot,
+						MulticornExecState * state);
 char	   *getRowIdColumn(PyObject *fdw_instance);
 PyObject   *optionsListToPyDict(List *options);
 const char *getPythonEncodingName(void);
@@ -196,30 +344,46 @@ void getRelSize(MulticornPlanState * state,
 		double *rows,
 		int *width);
 
+List	   *getExactClauses(MulticornPlanState * state);
+
 List	   *pathKeys(MulticornPlanState * state);
 
 List	   *canSort(MulticornPlanState * state, List *deparsed);
 
 CacheEntry *getCacheEntry(Oid foreigntableid);
+void		callInstanceHook(CacheEntry *entry, MulticornHook hook, int level);
 UserMapping *multicorn_GetUserMapping(Oid userid, Oid serverid);
 
 
 /* Hash table mapping oid to fdw instances */
 extern PGDLLIMPORT HTAB *InstancesHash;
 
+/* Entries of InstancesHash taking part in the current transaction */
+extern CacheEntry *XactInstances;
+
 /* link to traceback module for error handling.  Need to grab
    it early it case it's an OOM error. */
 extern PyObject   *tracebackModule;
 
 
 
+/* row.c */
+void		initRowMapping(MulticornModifyState * modstate, int natts);
+PyObject   *slotToRowMapping(TupleTableSlot *slot,
+				 MulticornModifyState * modstate);
+void		detachRowMapping(PyObject *p_row);
+
+
 /* query.c */
 void extractRestrictions(Relids base_relids,
 					Expr *node,
 					List **quals);
+bool		isStableExpression(Expr *expr);
 List	   *extractColumns(List *reltargetlist, List *restrictinfolist);
 void initConversioninfo(ConversionInfo ** cinfo,
 		AttInMetadata *attinmeta);
+void initNumericConversion(ConversionInfo ** cinfos, int natts,
+		Oid foreigntableid);
 
 Value *colnameFromVar(Var *var, PlannerInfo *root,
 		MulticornPlanState * state);
@@ -236,11 +400,16 @@ List	*findPaths(PlannerInfo *root, RelOptInfo *baserel, List *possiblePaths,
 List        *deparse_sortgroup(PlannerInfo *root, Oid foreigntableid, RelOptInfo *rel);
 
 PyObject   *datumToPython(Datum node, Oid typeoid, ConversionInfo * cinfo);
+PyToDatumFunc getPyToDatumFunc(Oid typeoid);
+bool pydictToHstoreDatum(PyObject *pyobject, ConversionInfo * cinfo,
+					Datum *value);
 
 List	*serializeDeparsedSortGroup(List *pathkeys);
 List	*deserializeDeparsedSortGroup(List *items);
 
 void multicorn_call_plpython(const char *python_script);
+InlineCodeBlock *multicorn_make_codeblock(const char *python_script);
+void multicorn_call_codeblock(InlineCodeBlock *codeblock);
 void multicorn_init(void);
 
 #endif   /* PG_MULTICORN_H */
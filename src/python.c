@@ -8,13 +8,20 @@
 #include "utils/numeric.h"
 #include "utils/date.h"
 #include "utils/timestamp.h"
+#include "utils/uuid.h"
 #include "utils/array.h"
+#include "utils/json.h"
+#if PG_VERSION_NUM >= 90400
+#include "utils/jsonb.h"
+#endif
 #include "utils/catcache.h"
+#include "utils/inval.h"
 #include "utils/memutils.h"
 #include "utils/resowner.h"
 #include "utils/rel.h"
 #include "utils/rel.h"
 #include "executor/nodeSubplan.h"
+#include "nodes/nodeFuncs.h"
 #include "bytesobject.h"
 #include "mb/pg_wchar.h"
 #include "access/xact.h"
@@ -29,7 +36,22 @@ bool		compareColumns(List *columns1, List *columns2);
 
 PyObject   *getClass(PyObject *className);
 PyObject   *valuesToPySet(List *targetlist);
-PyObject   *qualDefsToPyList(List *quallist, ConversionInfo ** cinfo);
+PyObject   *qualDefsToPyList(List *quallist, ConversionInfo ** cinfo,
+				 bool bool_quals, bool expression_quals);
+static bool fdwWantsQuals(PyObject *fdw_instance, const char *attribute);
+static bool fdwOverrides(PyObject *fdw_instance, const char *method);
+static bool isQualWanted(MulticornBaseQual * qual, bool bool_quals,
+			 bool expression_quals);
+static PyObject *qualToPython(MulticornBaseQual * qual, ConversionInfo ** cinfos);
+static PyObject *exprQualToPython(MulticornExprQual * qual,
+				 ConversionInfo ** cinfos);
+static bool initParamQuals(MulticornBaseQual * qual, MulticornExecState * state,
+			   ForeignScanState *node);
+static PyObject *exprToPython(Expr *expr, ConversionInfo ** cinfos);
+static PyObject *instantiateQuals(PyObject *p_quals, List *dynamic_quals,
+				 ConversionInfo ** cinfos, bool skip_missing);
+static void evaluateParamQual(MulticornParamQualState * param_state,
+				  ExprContext *econtext);
 PyObject *pythonQual(char *operatorname, PyObject *value,
 		   ConversionInfo * cinfo,
 		   bool is_array,
@@ -54,10 +76,26 @@ PyObject   *datumNumberToPython(Datum node, ConversionInfo * cinfo);
 PyObject   *datumDateToPython(Datum datum, ConversionInfo * cinfo);
 PyObject   *datumTimestampToPython(Datum datum, ConversionInfo * cinfo);
 PyObject   *datumIntToPython(Datum datum, ConversionInfo * cinfo);
+PyObject   *datumBigIntToPython(Datum datum, ConversionInfo * cinfo);
+PyObject   *datumFloatToPython(Datum datum, Oid type, ConversionInfo * cinfo);
+PyObject   *datumBoolToPython(Datum datum, ConversionInfo * cinfo);
 PyObject   *datumArrayToPython(Datum datum, Oid type, ConversionInfo * cinfo);
+PyObject   *qualValueToPython(Datum datum, Oid type, bool is_array,
+				  ConversionInfo * cinfo);
 PyObject   *datumByteaToPython(Datum datum, ConversionInfo * cinfo);
 PyObject   *datumUnknownToPython(Datum datum, ConversionInfo * cinfo, Oid type);
 
+#if PG_VERSION_NUM >= 100000
+static bool pydatetimeToTimestampDatum(PyObject *pyobject,
+						   ConversionInfo * cinfo, Datum *value);
+static bool pydatetimeToTimestampTzDatum(PyObject *pyobject,
+							 ConversionInfo * cinfo, Datum *value);
+static bool pydateToDateDatum(PyObject *pyobject, ConversionInfo * cinfo,
+				  Datum *value);
+static bool pytimeToTimeDatum(PyObject *pyobject, ConversionInfo * cinfo,
+				  Datum *value);
+#endif
+
 
 void pythonDictToTuple(PyObject *p_value,
 				  TupleTableSlot *slot,
@@ -96,6 +134,38 @@ void appendBinaryStringInfoQuote(StringInfo buffer,
 
 
 static void begin_remote_xact(CacheEntry * entry);
+static void importDateTime(void);
+static void setInstanceHooks(CacheEntry *entry);
+
+/*
+ * Import the datetime C API, the first time it is needed.
+ */
+static void
+importDateTime(void)
+{
+	if (PyDateTimeAPI == NULL)
+	{
+		PyDateTime_IMPORT;
+	}
+}
+
+/* Classes of the values with their own converters, imported when needed */
+static PyObject *decimalClass = NULL;
+static PyObject *uuidClass = NULL;
+
+/* Classes of the quals, imported once as they are built on every rescan */
+static PyObject *qualClass = NULL;
+static PyObject *boolQualClass = NULL;
+static PyObject *expressionQualClass = NULL;
+
+static void
+importConverterClass(PyObject **p_class, const char *className)
+{
+	if (*p_class == NULL)
+	{
+		*p_class = getClassString(className);
+	}
+}
 
 /*
  * Get a (python) encoding name for an attribute.
@@ -112,6 +182,28 @@ getPythonEncodingName()
 	return encoding_name;
 }
 
+/*
+ * Get the bytes of a python unicode string in the database encoding.
+ * For UTF8 databases they are borrowed from the string itself, which caches
+ * its UTF-8 form; otherwise *p_encoded is set to a new bytes object holding
+ * them, which the caller has to release.  Returns NULL on python errors.
+ */
+static const char *
+pyunicodeAsPgBytes(PyObject *pyobject, Py_ssize_t *size, PyObject **p_encoded)
+{
+	*p_encoded = NULL;
+#if PY_MAJOR_VERSION >= 3
+	if (GetDatabaseEncoding() == PG_UTF8)
+		return PyUnicode_AsUTF8AndSize(pyobject, size);
+#endif
+	*p_encoded = PyUnicode_AsEncodedString(pyobject, getPythonEncodingName(),
+										   NULL);
+	if (*p_encoded == NULL)
+		return NULL;
+	*size = PyBytes_GET_SIZE(*p_encoded);
+	return PyBytes_AS_STRING(*p_encoded);
+}
+
 char *
 PyUnicode_AsPgString(PyObject *p_unicode)
 {
@@ -270,7 +362,8 @@ valuesToPySet(List *targetlist)
 }
 
 PyObject *
-qualDefsToPyList(List *qual_list, ConversionInfo ** cinfos)
+qualDefsToPyList(List *qual_list, ConversionInfo ** cinfos, bool bool_quals,
+				 bool expression_quals)
 {
 	ListCell   *lc;
 	PyObject   *p_quals = PyList_New(0);
@@ -279,9 +372,10 @@ qualDefsToPyList(List *qual_list, ConversionInfo ** cinfos)
 	{
 		MulticornBaseQual *qual_def = (MulticornBaseQual *) lfirst(lc);
 
-		if (qual_def->right_type == T_Const)
+		/* Quals compared to a parameter are not converted at this point */
+		if (isQualWanted(qual_def, bool_quals, expression_quals))
 		{
-			PyObject   *python_qual = qualdefToPython((MulticornConstQual *) qual_def, cinfos);
+			PyObject   *python_qual = qualToPython(qual_def, cinfos);
 
 			if (python_qual != NULL)
 			{
@@ -600,6 +694,12 @@ getCacheEntry(Oid foreigntableid)
 		entry->options = NULL;
 		entry->columns = NULL;
 		entry->xact_depth = 0;
+		memset(entry->hooks, 0, sizeof(entry->hooks));
+		if (!found)
+		{
+			entry->xact_next = NULL;
+			entry->in_xact = false;
+		}
 		needInitialization = true;
 	}
 	else
@@ -635,6 +735,7 @@ getCacheEntry(Oid foreigntableid)
  	                           *p_tempContext = NULL;
 
 		entry->value = NULL;
+		setInstanceHooks(entry);
 		getColumnsFromTable(desc, &p_columns, &columns);
 		PyDict_DelItemString(p_options, "wrapper");
 		p_instance = PyObject_CallFunction(p_class, "(O,O)", p_options,
@@ -651,7 +752,8 @@ getCacheEntry(Oid foreigntableid)
 		Py_DECREF(p_columns);
 		errorCheck();
 		entry->value = p_instance;
-		
+		setInstanceHooks(entry);
+
 		/* Save the memory context in the object,
 		 * so it's not destroyed until the object is.
 		 */
@@ -694,6 +796,68 @@ getInstance(Oid foreigntableid)
 }
 
 
+/* Names of the python methods called for each MulticornHook */
+static const char *hookNames[MULTICORN_NUM_HOOKS] = {
+	"pre_commit",
+	"commit",
+	"rollback",
+	"sub_commit",
+	"sub_rollback",
+	"end_modify"
+};
+
+/*
+ * (Re)bind the lifecycle hooks to the current instance, so that they don't
+ * have to be looked up by name on every transaction event.
+ */
+static void
+setInstanceHooks(CacheEntry *entry)
+{
+	int			i;
+
+	for (i = 0; i < MULTICORN_NUM_HOOKS; i++)
+	{
+		Py_XDECREF(entry->hooks[i]);
+		entry->hooks[i] = NULL;
+		if (entry->value != NULL)
+		{
+			entry->hooks[i] = PyObject_GetAttrString(entry->value,
+													 hookNames[i]);
+			/* Missing hooks are reported when they are called. */
+			PyErr_Clear();
+		}
+	}
+}
+
+/*
+ * Call one of the lifecycle hooks of a cached instance.
+ * The subtransaction hooks are given the transaction nest level.
+ * Errors are left for the caller to check.
+ */
+void
+callInstanceHook(CacheEntry *entry, MulticornHook hook, int level)
+{
+	bool		with_level = (hook == MULTICORN_HOOK_SUB_COMMIT ||
+							  hook == MULTICORN_HOOK_SUB_ROLLBACK);
+	PyObject   *p_result;
+
+	if (entry->hooks[hook] == NULL)
+	{
+		/* Let python raise the appropriate error. */
+		if (with_level)
+			p_result = PyObject_CallMethod(entry->value, (char *) hookNames[hook],
+										   "(i)", level);
+		else
+			p_result = PyObject_CallMethod(entry->value, (char *) hookNames[hook],
+										   "()");
+	}
+	else if (with_level)
+		p_result = PyObject_CallFunction(entry->hooks[hook], "(i)", level);
+	else
+		p_result = PyObject_CallObject(entry->hooks[hook], NULL);
+	Py_XDECREF(p_result);
+}
+
 static void
 begin_remote_xact(CacheEntry * entry)
 {
@@ -707,6 +871,16 @@ begin_remote_xact(CacheEntry * entry)
 		Py_XDECREF(rv);
 		errorCheck();
 		entry->xact_depth = 1;
+		/*
+		 * A re-initialized entry may still be linked, but must not be
+		 * linked twice.
+		 */
+		if (!entry->in_xact)
+		{
+			entry->xact_next = XactInstances;
+			entry->in_xact = true;
+			XactInstances = entry;
+		}
 	}
 
 	while (entry->xact_depth < curlevel)
@@ -739,7 +913,10 @@ getRelSize(MulticornPlanState * state,
 			   *p_startup_cost;
 
 	p_targets_set = valuesToPySet(state->target_list);
-	p_quals = qualDefsToPyList(state->qual_list, state->cinfos);
+	p_quals = qualDefsToPyList(state->qual_list, state->cinfos,
+							   fdwWantsQuals(state->fdw_instance, "bool_quals"),
+							   fdwWantsQuals(state->fdw_instance,
+											 "expression_quals"));
 	p_rows_and_width = PyObject_CallMethod(state->fdw_instance, "get_rel_size",
 										   "(O,O)", p_quals, p_targets_set);
 	errorCheck();
@@ -762,6 +939,82 @@ getRelSize(MulticornPlanState * state,
 	Py_DECREF(p_rows_and_width);
 }
 
+/*
+ * Ask the fdw which quals it enforces itself, by calling its get_exact_quals
+ * method with those whose value is known at planning time.  Fdws which do
+ * not override it are not asked.
+ *
+ * Returns the list of the clauses of the quals it claimed, which must be
+ * among the instances it was given.
+ */
+List *
+getExactClauses(MulticornPlanState * state)
+{
+	bool		bool_quals,
+				expression_quals;
+	List	   *offered = NIL,
+			   *result = NIL;
+	ListCell   *lc_qual,
+			   *lc_clause;
+	PyObject   *p_quals,
+			   *p_exact,
+			   *p_iter,
+			   *p_item;
+
+	if (!fdwOverrides(state->fdw_instance, "get_exact_quals"))
+		return NIL;
+	bool_quals = fdwWantsQuals(state->fdw_instance, "bool_quals");
+	expression_quals = fdwWantsQuals(state->fdw_instance, "expression_quals");
+	p_quals = PyList_New(0);
+	forboth(lc_qual, state->qual_list, lc_clause, state->qual_clauses)
+	{
+		MulticornBaseQual *qual_def = (MulticornBaseQual *) lfirst(lc_qual);
+
+		if (isQualWanted(qual_def, bool_quals, expression_quals))
+		{
+			PyObject   *python_qual = qualToPython(qual_def, state->cinfos);
+
+			if (python_qual != NULL)
+			{
+				PyList_Append(p_quals, python_qual);
+				Py_DECREF(python_qual);
+				offered = lappend(offered, lfirst(lc_clause));
+			}
+		}
+	}
+	if (offered == NIL)
+	{
+		Py_DECREF(p_quals);
+		return NIL;
+	}
+	p_exact = PyObject_CallMethod(state->fdw_instance, "get_exact_quals",
+								  "(O)", p_quals);
+	errorCheck();
+	p_iter = PyObject_GetIter(p_exact);
+	Py_DECREF(p_exact);
+	errorCheck();
+	while ((p_item = PyIter_Next(p_iter)))
+	{
+		Py_ssize_t	i;
+
+		for (i = 0; i < PyList_Size(p_quals); i++)
+		{
+			/* Distinct quals may compare equal, such as 1 and 1.0 */
+			if (p_item == PyList_GET_ITEM(p_quals, i))
+			{
+				result = list_append_unique_ptr(result,
+												list_nth(offered, i));
+				break;
+			}
+		}
+		Py_DECREF(p_item);
+	}
+	Py_DECREF(p_iter);
+	Py_DECREF(p_quals);
+	errorCheck();
+	return result;
+}
+
 PyObject *
 qualdefToPython(MulticornConstQual * qualdef, ConversionInfo ** cinfos)
 {
@@ -785,7 +1038,7 @@ qualdefToPython(MulticornConstQual * qualdef, ConversionInfo ** cinfos)
 		{
 			typeoid = cinfo->atttypoid;
 		}
-		p_value = datumToPython(value, typeoid, cinfo);
+		p_value = qualValueToPython(value, typeoid, is_array, cinfo);
 		if (p_value == NULL)
 		{
 			return NULL;
@@ -802,6 +1055,29 @@ qualdefToPython(MulticornConstQual * qualdef, ConversionInfo ** cinfos)
 }
 
 
+/*
+ * The operator of a python qual: its name, or a (name, use_or) tuple for
+ * "column op ANY(value)" and "column op ALL(value)".
+ */
+static PyObject *
+pythonQualOperator(char *operatorname, bool is_array, bool use_or)
+{
+	PyObject   *p_operatorname,
+			   *operator;
+
+	p_operatorname = PyUnicode_Decode(operatorname, strlen(operatorname), getPythonEncodingName(), NULL);
+	errorCheck();
+	if (!is_array)
+	{
+		return p_operatorname;
+	}
+	operator = Py_BuildValue("(O, O)", p_operatorname,
+							 use_or ? Py_True : Py_False);
+	Py_DECREF(p_operatorname);
+	errorCheck();
+	return operator;
+}
+
 PyObject *
 pythonQual(char *operatorname,
 		   PyObject *value,
@@ -810,36 +1086,12 @@ pythonQual(char *operatorname,
 		   bool use_or,
 		   Oid typeoid)
 {
-	PyObject   *qualClass = getClassString("multicorn.Qual"),
-			   *qualInstance,
-			   *p_operatorname,
+	PyObject   *qualInstance,
 			   *operator,
 			   *columnName;
 
-	p_operatorname = PyUnicode_Decode(operatorname, strlen(operatorname), getPythonEncodingName(), NULL);
-	errorCheck();
-	if (is_array)
-	{
-		PyObject   *arrayOpType;
-
-
-		if (use_or)
-		{
-			arrayOpType = Py_True;
-		}
-		else
-		{
-			arrayOpType = Py_False;
-		}
-		operator = Py_BuildValue("(O, O)", p_operatorname, arrayOpType);
-		Py_DECREF(p_operatorname);
-		errorCheck();
-	}
-	else
-	{
-		operator = p_operatorname;
-	}
-
+	importConverterClass(&qualClass, "multicorn.Qual");
+	operator = pythonQualOperator(operatorname, is_array, use_or);
 	columnName = PyUnicode_Decode(cinfo->attrname, strlen(cinfo->attrname), getPythonEncodingName(), NULL);
 	qualInstance = PyObject_CallFunction(qualClass, "(O,O,O)",
 										 columnName,
@@ -848,7 +1100,6 @@ pythonQual(char *operatorname,
 	errorCheck();
 	Py_DECREF(value);
 	Py_DECREF(operator);
-	Py_DECREF(qualClass);
 	Py_DECREF(columnName);
 	return qualInstance;
 }
@@ -919,426 +1170,2028 @@ getDeparsedSortGroup(PyObject *sortKey)
 
 
 /*
- * Execute the query in the python fdw, and returns an iterator.
+ * Whether the fdw asked for a kind of quals it does not get by default,
+ * with the bool_quals or expression_quals attribute.
  */
-PyObject *
-execute(ForeignScanState *node, ExplainState *es)
+static bool
+fdwWantsQuals(PyObject *fdw_instance, const char *attribute)
 {
-	MulticornExecState *state = node->fdw_state;
-	PyObject   *p_targets_set,
-			   *p_quals = PyList_New(0),
-			   *p_pathkeys = PyList_New(0),
-			   *p_iterable,
-			   *p_method;
-	ListCell   *lc;
+	PyObject   *p_wanted = PyObject_GetAttrString(fdw_instance, attribute);
+	bool		result;
 
-	ExprContext *econtext = node->ss.ps.ps_ExprContext;
-
-	foreach(lc, state->qual_list)
+	if (p_wanted == NULL)
 	{
-		MulticornBaseQual *qual = lfirst(lc);
-		MulticornConstQual *newqual = NULL;
-		bool		isNull;
-		ExprState  *expr_state = NULL;
-
-		switch (qual->right_type)
-		{
-			case T_Param:
-				expr_state = ExecInitExpr(((MulticornParamQual *) qual)->expr,
-										  (PlanState *) node);
-				newqual = palloc0(sizeof(MulticornConstQual));
-				newqual->base.right_type = T_Const;
-				newqual->base.varattno = qual->varattno;
-				newqual->base.opname = qual->opname;
-				newqual->base.isArray = qual->isArray;
-				newqual->base.useOr = qual->useOr;
-
-				#if PG_VERSION_NUM >= 100000
-				newqual->value = ExecEvalExpr(expr_state, econtext, &isNull);
-				#else
-				newqual->value = ExecEvalExpr(expr_state, econtext, &isNull, NULL);
-				#endif
-				newqual->base.typeoid = ((Param*) ((MulticornParamQual *) qual)->expr)->paramtype;
-				newqual->isnull = isNull;
-				break;
-			case T_Const:
-				newqual = (MulticornConstQual *) qual;
-				break;
-			default:
-				break;
-		}
-		if (newqual != NULL)
-		{
-			PyObject   *python_qual = qualdefToPython((MulticornConstQual *) newqual, state->cinfos);
-
-			if (python_qual != NULL)
-			{
-				PyList_Append(p_quals, python_qual);
-				Py_DECREF(python_qual);
-			}
-		}
+		/* Not inheriting from ForeignDataWrapper */
+		PyErr_Clear();
+		return false;
 	}
-	/* Transform every object to a suitable python representation */
-	p_targets_set = valuesToPySet(state->target_list);
+	result = PyObject_IsTrue(p_wanted) == 1;
+	Py_DECREF(p_wanted);
+	return result;
+}
 
-	foreach(lc, state->pathkeys)
-	{
-		MulticornDeparsedSortGroup *pathkey = (MulticornDeparsedSortGroup *) lfirst(lc);
-		PyObject *python_sortkey = getSortKey(pathkey);
-		PyList_Append(p_pathkeys, python_sortkey);
-		Py_DECREF(python_sortkey);
-	}
-	{
-		PyObject * args,
-				 * kwargs = PyDict_New();
-		if(PyList_Size(p_pathkeys) > 0){
-			PyDict_SetItemString(kwargs, "sortkeys", p_pathkeys);
-		}
-		if(es != NULL){
-			PyObject * verbose;
-			if(es->verbose){
-				verbose = Py_True;
-			} else {
-				verbose = Py_False;
-			}
-			p_method = PyObject_GetAttrString(state->fdw_instance, "explain");
-			args = PyTuple_Pack(2, p_quals, p_targets_set);
-			PyDict_SetItemString(kwargs, "verbose", verbose);
-			errorCheck();
-		} else {
-			p_method = PyObject_GetAttrString(state->fdw_instance, "execute");
-			errorCheck();
-			args = PyTuple_Pack(2, p_quals, p_targets_set);
-			errorCheck();
-		}
-		p_iterable = PyObject_Call(p_method, args, kwargs);
-		errorCheck();
-		Py_DECREF(p_method);
-		Py_DECREF(args);
-		Py_DECREF(kwargs);
-	}
+/*
+ * Get the function behind a method of a class, which python 2 wraps in a
+ * new unbound method on every lookup.
+ */
+static PyObject *
+getClassFunction(PyObject *p_class, const char *method)
+{
+	PyObject   *p_method = PyObject_GetAttrString(p_class, method),
+			   *p_function;
 
-	errorCheck();
-	if (p_iterable == Py_None){
-		state->p_iterator = p_iterable;
+	if (p_method == NULL)
+	{
+		PyErr_Clear();
+		return NULL;
 	}
-	else
+	p_function = PyObject_GetAttrString(p_method, "__func__");
+	if (p_function == NULL)
 	{
-		state->p_iterator = PyObject_GetIter(p_iterable);
+		PyErr_Clear();
+		return p_method;
 	}
-	Py_DECREF(p_quals);
-	Py_DECREF(p_targets_set);
-	Py_DECREF(p_pathkeys);
-	Py_DECREF(p_iterable);
-	errorCheck();
-	return state->p_iterator;
+	Py_DECREF(p_method);
+	return p_function;
 }
 
-
-void
-pynumberToCString(PyObject *pyobject, StringInfo buffer,
-				  ConversionInfo * cinfo)
+/*
+ * Whether the class of the fdw defines its own version of an optional
+ * method of ForeignDataWrapper, so that the default one is not called for
+ * nothing.
+ */
+static bool
+fdwOverrides(PyObject *fdw_instance, const char *method)
 {
-	PyObject   *pTempStr;
-	char	   *tempbuffer;
-	Py_ssize_t	strlength = 0;
-
-	pTempStr = PyObject_Str(pyobject);
-	PyString_AsStringAndSize(pTempStr, &tempbuffer, &strlength);
-	appendBinaryStringInfo(buffer, tempbuffer, strlength);
-	Py_DECREF(pTempStr);
+	PyObject   *p_base = getClassString("multicorn.ForeignDataWrapper"),
+			   *p_default = getClassFunction(p_base, method),
+			   *p_function = getClassFunction((PyObject *) Py_TYPE(fdw_instance),
+											  method);
+	bool		result = p_function != NULL && p_function != p_default;
+
+	Py_XDECREF(p_function);
+	Py_XDECREF(p_default);
+	Py_DECREF(p_base);
+	return result;
 }
 
-void
-pyunicodeToCString(PyObject *pyobject, StringInfo buffer,
-				   ConversionInfo * cinfo)
+static bool
+isQualWanted(MulticornBaseQual * qual, bool bool_quals, bool expression_quals)
 {
-	char	   *tempbuffer;
-	Py_ssize_t	strlength = 0;
-	PyObject   *pTempStr;
-	pTempStr = PyUnicode_AsEncodedString(pyobject, getPythonEncodingName(), NULL);
-	errorCheck();
-	PyBytes_AsStringAndSize(pTempStr, &tempbuffer, &strlength);
-	appendBinaryStringInfoQuote(buffer, tempbuffer, strlength, cinfo->need_quote);
-	Py_DECREF(pTempStr);
+	switch (qual->right_type)
+	{
+		case T_BoolExpr:
+			return bool_quals;
+		case T_OpExpr:
+			return expression_quals;
+		default:
+			return true;
+	}
 }
 
-void
-pystringToCString(PyObject *pyobject, StringInfo buffer,
-				  ConversionInfo * cinfo)
+/*
+ * Convert a qual to a python Qual, BoolQual or ExpressionQual, or return
+ * NULL if it cannot be converted.  Quals compared to a parameter are only
+ * supported during a scan: they take the value initParamQuals set up for
+ * them, as evaluated by refreshParamQuals.
+ */
+static PyObject *
+qualToPython(MulticornBaseQual * qual, ConversionInfo ** cinfos)
 {
-	char	   *tempbuffer;
-	Py_ssize_t	strlength = 0;
+	MulticornParamQualState *param_state;
+	MulticornBoolQual *bool_qual;
+	PyObject   *python_qual = NULL,
+			   *p_args;
+	ListCell   *lc;
 
-	if (PyString_AsStringAndSize(pyobject, &tempbuffer, &strlength) < 0)
+	switch (qual->right_type)
 	{
-		ereport(WARNING,
-				(errmsg("An error occured while decoding the %s column",
-						cinfo->attrname),
-				 errhint("You should maybe return unicode instead?")));
+		case T_Param:
+			param_state = ((MulticornParamQual *) qual)->state;
+			if (param_state == NULL)
+				break;
+			python_qual = PyObject_CallFunction(qualClass, "(O,O,O)",
+												param_state->p_left,
+												param_state->p_operator,
+												param_state->p_value);
+			errorCheck();
+			break;
+		case T_Const:
+			python_qual = qualdefToPython((MulticornConstQual *) qual, cinfos);
+			break;
+		case T_BoolExpr:
+			bool_qual = (MulticornBoolQual *) qual;
+			if (bool_qual->p_args != NULL)
+			{
+				p_args = instantiateQuals(bool_qual->p_args,
+										  bool_qual->dynamic_args,
+										  cinfos, false);
+				if (p_args == NULL)
+					return NULL;
+			}
+			else
+			{
+				p_args = PyList_New(0);
+				foreach(lc, bool_qual->args)
+				{
+					PyObject   *p_arg = qualToPython(lfirst(lc), cinfos);
+
+					if (p_arg == NULL)
+					{
+						Py_DECREF(p_args);
+						return NULL;
+					}
+					PyList_Append(p_args, p_arg);
+					Py_DECREF(p_arg);
+				}
+			}
+			importConverterClass(&boolQualClass, "multicorn.BoolQual");
+			python_qual = PyObject_CallFunction(boolQualClass, "(s,O)",
+												bool_qual->boolop == AND_EXPR ? "and" :
+												bool_qual->boolop == OR_EXPR ? "or" : "not",
+												p_args);
+			Py_DECREF(p_args);
+			errorCheck();
+			break;
+		case T_OpExpr:
+			python_qual = exprQualToPython((MulticornExprQual *) qual, cinfos);
+			break;
+		default:
+			break;
+	}
+	return python_qual;
+}
+
+/*
+ * Convert an expression qual.  When its right operand is evaluated by the
+ * executor, it is handled like the value of a param qual, and its left
+ * operand and operator are those initQuals built.
+ */
+static PyObject *
+exprQualToPython(MulticornExprQual * qual, ConversionInfo ** cinfos)
+{
+	PyObject   *p_left,
+			   *p_operator,
+			   *p_value,
+			   *python_qual;
+
+	importConverterClass(&expressionQualClass, "multicorn.ExpressionQual");
+	if (qual->right_is_param)
+	{
+		if (qual->state == NULL)
+			return NULL;
+		python_qual = PyObject_CallFunction(expressionQualClass, "(O,O,O)",
+											qual->state->p_left,
+											qual->state->p_operator,
+											qual->state->p_value);
+		errorCheck();
+		return python_qual;
+	}
+	p_value = exprToPython(qual->right, cinfos);
+	p_left = exprToPython(qual->left, cinfos);
+	p_operator = PyUnicode_Decode(qual->base.opname, strlen(qual->base.opname),
+								  getPythonEncodingName(), NULL);
+	python_qual = PyObject_CallFunction(expressionQualClass, "(O,O,O)", p_left,
+										p_operator, p_value);
+	Py_DECREF(p_left);
+	Py_DECREF(p_operator);
+	Py_DECREF(p_value);
+	errorCheck();
+	return python_qual;
+}
+
+/*
+ * Convert an operand of an expression qual: columns become Column
+ * instances, functions FunctionCall ones, and constants their python value.
+ */
+static PyObject *
+exprToPython(Expr *expr, ConversionInfo ** cinfos)
+{
+	ConversionInfo *cinfo;
+	Const	   *constant;
+	FuncExpr   *func;
+	char	   *funcname,
+			   *nspname;
+	PyObject   *p_name,
+			   *p_schema,
+			   *p_args,
+			   *p_class,
+			   *result;
+	ListCell   *lc;
+
+	switch (nodeTag(expr))
+	{
+		case T_Var:
+			cinfo = cinfos[((Var *) expr)->varattno - 1];
+			p_name = PyUnicode_Decode(cinfo->attrname, strlen(cinfo->attrname),
+									  getPythonEncodingName(), NULL);
+			p_class = getClassString("multicorn.Column");
+			result = PyObject_CallFunction(p_class, "(O)", p_name);
+			Py_DECREF(p_class);
+			Py_DECREF(p_name);
+			break;
+		case T_Const:
+			constant = (Const *) expr;
+			if (constant->constisnull)
+			{
+				Py_INCREF(Py_None);
+				return Py_None;
+			}
+			result = datumToPython(constant->constvalue, constant->consttype,
+								   NULL);
+			break;
+		case T_RelabelType:
+			return exprToPython(((RelabelType *) expr)->arg, cinfos);
+		case T_FuncExpr:
+			func = (FuncExpr *) expr;
+			p_args = PyList_New(0);
+			foreach(lc, func->args)
+			{
+				PyObject   *p_arg = exprToPython(lfirst(lc), cinfos);
+
+				PyList_Append(p_args, p_arg);
+				Py_DECREF(p_arg);
+			}
+			funcname = get_func_name(func->funcid);
+			p_name = PyUnicode_Decode(funcname, strlen(funcname),
+									  getPythonEncodingName(), NULL);
+			/* Functions are told apart by their schema too */
+			nspname = get_namespace_name(get_func_namespace(func->funcid));
+			p_schema = PyUnicode_Decode(nspname, strlen(nspname),
+										getPythonEncodingName(), NULL);
+			p_class = getClassString("multicorn.FunctionCall");
+			result = PyObject_CallFunction(p_class, "(O,O,O)", p_name, p_args,
+										   p_schema);
+			Py_DECREF(p_class);
+			Py_DECREF(p_name);
+			Py_DECREF(p_schema);
+			Py_DECREF(p_args);
+			break;
+		default:
+			elog(ERROR, "unexpected node in an expression qual: %d",
+				 (int) nodeTag(expr));
+			return NULL;
+	}
+	errorCheck();
+	return result;
+}
+
+/*
+ * Set up the expression state of a parameter for the scan.  Values which
+ * stay the same for the whole query, such as now() or current_user, are
+ * set apart in stable_quals.
+ */
+static MulticornParamQualState *
+initParamQual(Expr *expr, bool isArray, ConversionInfo * cinfo,
+			  MulticornExecState * state, ForeignScanState *node)
+{
+	MulticornParamQualState *param_state = palloc0(sizeof(MulticornParamQualState));
+
+	param_state->expr = expr;
+	param_state->expr_state = ExecInitExpr(expr, (PlanState *) node);
+	param_state->typeoid = exprType((Node *) expr);
+	param_state->isArray = isArray;
+	param_state->cinfo = cinfo;
+	Py_INCREF(Py_None);
+	param_state->p_value = Py_None;
+	if (isStableExpression(expr))
+		state->stable_quals = lappend(state->stable_quals, param_state);
+	else
+		state->param_quals = lappend(state->param_quals, param_state);
+	return param_state;
+}
+
+/*
+ * Set up the parameters of a qual and of those it is made of, and return
+ * whether there are any.  What does not depend on their values is built
+ * here, so that a new execution only has to instantiate the python quals.
+ */
+static bool
+initParamQuals(MulticornBaseQual * qual, MulticornExecState * state,
+			   ForeignScanState *node)
+{
+	MulticornParamQual *param_qual;
+	MulticornExprQual *expr_qual;
+	MulticornBoolQual *bool_qual;
+	MulticornParamQualState *param_state;
+	ConversionInfo *cinfo;
+	List	   *dynamic_args = NIL;
+	ListCell   *lc;
+
+	switch (qual->right_type)
+	{
+		case T_Param:
+			param_qual = (MulticornParamQual *) qual;
+			cinfo = state->cinfos[qual->varattno - 1];
+			param_state = initParamQual(param_qual->expr, qual->isArray, cinfo,
+										state, node);
+			param_state->p_left = PyUnicode_Decode(cinfo->attrname,
+												   strlen(cinfo->attrname),
+												   getPythonEncodingName(),
+												   NULL);
+			errorCheck();
+			param_state->p_operator = pythonQualOperator(qual->opname,
+														 qual->isArray,
+														 qual->useOr);
+			importConverterClass(&qualClass, "multicorn.Qual");
+			param_qual->state = param_state;
+			return true;
+		case T_BoolExpr:
+			bool_qual = (MulticornBoolQual *) qual;
+			foreach(lc, bool_qual->args)
+			{
+				if (initParamQuals(lfirst(lc), state, node))
+					dynamic_args = lappend(dynamic_args, lfirst(lc));
+			}
+			if (dynamic_args == NIL)
+				return false;
+			/* Build the args without parameters once */
+			bool_qual->p_args = PyList_New(0);
+			foreach(lc, bool_qual->args)
+			{
+				PyObject   *p_arg;
+
+				if (list_member_ptr(dynamic_args, lfirst(lc)))
+				{
+					PyList_Append(bool_qual->p_args, Py_None);
+					continue;
+				}
+				p_arg = qualToPython(lfirst(lc), state->cinfos);
+				if (p_arg == NULL)
+				{
+					/* It can never be built: leave it to qualToPython */
+					Py_CLEAR(bool_qual->p_args);
+					return true;
+				}
+				PyList_Append(bool_qual->p_args, p_arg);
+				Py_DECREF(p_arg);
+			}
+			bool_qual->dynamic_args = dynamic_args;
+			return true;
+		case T_OpExpr:
+			expr_qual = (MulticornExprQual *) qual;
+			if (!expr_qual->right_is_param)
+				return false;
+			param_state = initParamQual(expr_qual->right, false, NULL,
+										state, node);
+			param_state->p_left = exprToPython(expr_qual->left, state->cinfos);
+			param_state->p_operator = PyUnicode_Decode(qual->opname,
+													   strlen(qual->opname),
+													   getPythonEncodingName(),
+													   NULL);
+			errorCheck();
+			importConverterClass(&expressionQualClass,
+								 "multicorn.ExpressionQual");
+			expr_qual->state = param_state;
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Build the python quals of a scan.  Those with a constant value are built
+ * once and for all.  Those holding a parameter get their expression states,
+ * field names and operators here, and are instantiated again by execute
+ * with their values for each execution, so that fdws keeping them don't see
+ * them change.
+ */
+void
+initQuals(MulticornExecState * state, ForeignScanState *node)
+{
+	ListCell   *lc;
+	bool		bool_quals = fdwWantsQuals(state->fdw_instance, "bool_quals"),
+				expression_quals = fdwWantsQuals(state->fdw_instance,
+												 "expression_quals");
+
+	state->p_quals = PyList_New(0);
+	state->dynamic_quals = NIL;
+	state->param_quals = NIL;
+	state->stable_quals = NIL;
+	state->stable_quals_evaluated = false;
+	foreach(lc, state->qual_list)
+	{
+		MulticornBaseQual *qual = lfirst(lc);
+		PyObject   *python_qual;
+
+		if (!isQualWanted(qual, bool_quals, expression_quals))
+			continue;
+		if (initParamQuals(qual, state, node))
+		{
+			state->dynamic_quals = lappend(state->dynamic_quals, qual);
+			PyList_Append(state->p_quals, Py_None);
+			continue;
+		}
+		python_qual = qualToPython(qual, state->cinfos);
+		if (python_qual != NULL)
+		{
+			PyList_Append(state->p_quals, python_qual);
+			Py_DECREF(python_qual);
+		}
+	}
+}
+
+static void
+evaluateParamQual(MulticornParamQualState * param_state, ExprContext *econtext)
+{
+	bool		isNull;
+	Datum		value;
+	PyObject   *p_value;
+
+#if PG_VERSION_NUM >= 100000
+	value = ExecEvalExpr(param_state->expr_state, econtext, &isNull);
+#else
+	value = ExecEvalExpr(param_state->expr_state, econtext, &isNull, NULL);
+#endif
+	if (isNull)
+	{
+		p_value = Py_None;
+		Py_INCREF(Py_None);
+	}
+	else
+	{
+		p_value = qualValueToPython(value, param_state->typeoid,
+									param_state->isArray, param_state->cinfo);
+		errorCheck();
+	}
+	Py_DECREF(param_state->p_value);
+	param_state->p_value = p_value;
+}
+
+static void
+freeParamQualState(MulticornParamQualState * param_state)
+{
+	Py_DECREF(param_state->p_value);
+	Py_XDECREF(param_state->p_left);
+	Py_XDECREF(param_state->p_operator);
+}
+
+static void
+freeBoolQualArgs(MulticornBaseQual * qual)
+{
+	MulticornBoolQual *bool_qual;
+	ListCell   *lc;
+
+	if (qual->right_type != T_BoolExpr)
+		return;
+	bool_qual = (MulticornBoolQual *) qual;
+	Py_CLEAR(bool_qual->p_args);
+	bool_qual->dynamic_args = NIL;
+	foreach(lc, bool_qual->args)
+	{
+		freeBoolQualArgs(lfirst(lc));
+	}
+}
+
+/*
+ * Release the python quals built by initQuals.
+ */
+void
+freeQuals(MulticornExecState * state)
+{
+	ListCell   *lc;
+
+	foreach(lc, state->param_quals)
+	{
+		freeParamQualState(lfirst(lc));
+	}
+	foreach(lc, state->stable_quals)
+	{
+		freeParamQualState(lfirst(lc));
+	}
+	foreach(lc, state->dynamic_quals)
+	{
+		freeBoolQualArgs(lfirst(lc));
+	}
+	Py_XDECREF(state->p_quals);
+	state->p_quals = NULL;
+	state->dynamic_quals = NIL;
+	state->param_quals = NIL;
+	state->stable_quals = NIL;
+}
+
+/*
+ * Evaluate the parameters of the param quals for this execution.  Stable
+ * ones are only evaluated the first time.  The others have no value when
+ * the scan is only explained, and are left alone if with_params is false.
+ */
+static void
+refreshParamQuals(ForeignScanState *node, bool with_params)
+{
+	MulticornExecState *state = node->fdw_state;
+	ListCell   *lc;
+
+	if (!state->stable_quals_evaluated)
+	{
+		foreach(lc, state->stable_quals)
+		{
+			evaluateParamQual(lfirst(lc), node->ss.ps.ps_ExprContext);
+		}
+		state->stable_quals_evaluated = true;
+	}
+	if (!with_params)
+		return;
+	foreach(lc, state->param_quals)
+	{
+		evaluateParamQual(lfirst(lc), node->ss.ps.ps_ExprContext);
+	}
+}
+
+/*
+ * Build a list of python quals from a template holding None for the
+ * dynamic ones.  Those which could not be built this time are left out if
+ * skip_missing, and otherwise make the whole list NULL.
+ */
+static PyObject *
+instantiateQuals(PyObject *p_quals, List *dynamic_quals,
+				 ConversionInfo ** cinfos, bool skip_missing)
+{
+	PyObject   *p_result = PyList_New(0);
+	int			dynamic = 0;
+	Py_ssize_t	i;
+
+	for (i = 0; i < PyList_Size(p_quals); i++)
+	{
+		PyObject   *python_qual = PyList_GET_ITEM(p_quals, i);
+
+		if (python_qual != Py_None)
+		{
+			PyList_Append(p_result, python_qual);
+			continue;
+		}
+		python_qual = qualToPython(list_nth(dynamic_quals, dynamic++),
+								   cinfos);
+		if (python_qual == NULL)
+		{
+			if (skip_missing)
+				continue;
+			Py_DECREF(p_result);
+			return NULL;
+		}
+		PyList_Append(p_result, python_qual);
+		Py_DECREF(python_qual);
+	}
+	return p_result;
+}
+
+/*
+ * The quals given to an execution of the scan: the fdw gets its own list,
+ * holding the quals built once and new ones for those with parameters.
+ */
+static PyObject *
+executionQuals(MulticornExecState * state)
+{
+	return instantiateQuals(state->p_quals, state->dynamic_quals,
+							state->cinfos, true);
+}
+
+/*
+ * Execute the query in the python fdw, and returns an iterator.
+ */
+PyObject *
+execute(ForeignScanState *node, ExplainState *es)
+{
+	MulticornExecState *state = node->fdw_state;
+	PyObject   *p_targets_set,
+			   *p_quals,
+			   *p_pathkeys,
+			   *p_iterable,
+			   *p_method;
+	ListCell   *lc;
+
+	refreshParamQuals(node, es == NULL);
+	p_pathkeys = PyList_New(0);
+	p_quals = executionQuals(state);
+	/* Transform every object to a suitable python representation */
+	if (state->projection != NULL)
+	{
+		int			i;
+
+		/* The columns, in the order of the returned sequences */
+		p_targets_set = PyList_New(state->projection_len);
+		for (i = 0; i < state->projection_len; i++)
+		{
+			PyObject   *p_key = state->cinfos[state->projection[i]]->attrkey;
+
+			Py_INCREF(p_key);
+			PyList_SET_ITEM(p_targets_set, i, p_key);
+		}
+	}
+	else
+	{
+		p_targets_set = valuesToPySet(state->target_list);
+	}
+
+	foreach(lc, state->pathkeys)
+	{
+		MulticornDeparsedSortGroup *pathkey = (MulticornDeparsedSortGroup *) lfirst(lc);
+		PyObject *python_sortkey = getSortKey(pathkey);
+		PyList_Append(p_pathkeys, python_sortkey);
+		Py_DECREF(python_sortkey);
+	}
+	{
+		PyObject * args,
+				 * kwargs = PyDict_New();
+		if(PyList_Size(p_pathkeys) > 0){
+			PyDict_SetItemString(kwargs, "sortkeys", p_pathkeys);
+		}
+		if(es != NULL){
+			PyObject * verbose;
+			if(es->verbose){
+				verbose = Py_True;
+			} else {
+				verbose = Py_False;
+			}
+			p_method = PyObject_GetAttrString(state->fdw_instance, "explain");
+			args = PyTuple_Pack(2, p_quals, p_targets_set);
+			PyDict_SetItemString(kwargs, "verbose", verbose);
+			errorCheck();
+		} else {
+			p_method = PyObject_GetAttrString(state->fdw_instance, "execute");
+			errorCheck();
+			args = PyTuple_Pack(2, p_quals, p_targets_set);
+			errorCheck();
+		}
+		p_iterable = PyObject_Call(p_method, args, kwargs);
+		errorCheck();
+		Py_DECREF(p_method);
+		Py_DECREF(args);
+		Py_DECREF(kwargs);
+	}
+
+	errorCheck();
+	if (p_iterable == Py_None){
+		state->p_iterator = p_iterable;
+	}
+	else
+	{
+		state->p_iterator = PyObject_GetIter(p_iterable);
+	}
+	Py_DECREF(p_quals);
+	Py_DECREF(p_targets_set);
+	Py_DECREF(p_pathkeys);
+	Py_DECREF(p_iterable);
+	errorCheck();
+	return state->p_iterator;
+}
+
+
+void
+pynumberToCString(PyObject *pyobject, StringInfo buffer,
+				  ConversionInfo * cinfo)
+{
+	PyObject   *pTempStr;
+	char	   *tempbuffer;
+	Py_ssize_t	strlength = 0;
+
+	pTempStr = PyObject_Str(pyobject);
+	PyString_AsStringAndSize(pTempStr, &tempbuffer, &strlength);
+	appendBinaryStringInfo(buffer, tempbuffer, strlength);
+	Py_DECREF(pTempStr);
+}
+
+void
+pyunicodeToCString(PyObject *pyobject, StringInfo buffer,
+				   ConversionInfo * cinfo)
+{
+	const char *tempbuffer;
+	Py_ssize_t	strlength = 0;
+	PyObject   *pTempStr;
+
+	tempbuffer = pyunicodeAsPgBytes(pyobject, &strlength, &pTempStr);
+	errorCheck();
+	appendBinaryStringInfoQuote(buffer, (char *) tempbuffer, strlength,
+								cinfo->need_quote);
+	Py_XDECREF(pTempStr);
+}
+
+void
+pystringToCString(PyObject *pyobject, StringInfo buffer,
+				  ConversionInfo * cinfo)
+{
+	char	   *tempbuffer;
+	Py_ssize_t	strlength = 0;
+
+	if (PyString_AsStringAndSize(pyobject, &tempbuffer, &strlength) < 0)
+	{
+		ereport(WARNING,
+				(errmsg("An error occured while decoding the %s column",
+						cinfo->attrname),
+				 errhint("You should maybe return unicode instead?")));
+	}
+	appendBinaryStringInfoQuote(buffer, tempbuffer, strlength, cinfo->need_quote);
+}
+
+void
+pysequenceToCString(PyObject *pyobject, StringInfo buffer,
+					ConversionInfo * cinfo)
+{
+	/* Its an array */
+	Py_ssize_t	i,
+				size = PySequence_Size(pyobject);
+	PyObject   *p_item;
+	int			previous_dims = cinfo->attndims,
+				previous_needquote = cinfo->need_quote;
+
+	if (cinfo->attndims == 0)
+	{
+		/* We are not supposed to be converted to an array. */
+		pyunknownToCstring(pyobject, buffer, cinfo);
+		return;
+	}
+	appendStringInfoChar(buffer, '{');
+	/* We are an array, so we need to quote stuff */
+	cinfo->need_quote = true;
+	cinfo->attndims = cinfo->attndims - 1;
+	for (i = 0; i < size; i++)
+	{
+		p_item = PySequence_GetItem(pyobject, i);
+		pyobjectToCString(p_item, buffer, cinfo);
+		Py_DECREF(p_item);
+		if (i != size - 1)
+		{
+			appendBinaryStringInfo(buffer, ", ", 2);
+		}
+	}
+	appendStringInfoChar(buffer, '}');
+	cinfo->attndims = previous_dims;
+	cinfo->need_quote = previous_needquote;
+}
+
+void
+pymappingToCString(PyObject *pyobject, StringInfo buffer,
+				   ConversionInfo * cinfo)
+{
+	PyObject   *items = PyMapping_Items(pyobject);
+	PyObject   *current_tuple;
+	Py_ssize_t	i;
+	Py_ssize_t	size = PyList_Size(items);
+	bool		need_quote = cinfo->need_quote;
+
+	cinfo->need_quote = true;
+	for (i = 0; i < size; i++)
+	{
+		current_tuple = PySequence_GetItem(items, i);
+		pyobjectToCString(PyTuple_GetItem(current_tuple, 0),
+						  buffer, cinfo);
+		appendBinaryStringInfo(buffer, "=>", 2);
+		pyobjectToCString(PyTuple_GetItem(current_tuple, 1),
+						  buffer, cinfo);
+		if (i != size - 1)
+		{
+			appendBinaryStringInfo(buffer, ", ", 2);
+		}
+		Py_DECREF(current_tuple);
+	}
+	Py_DECREF(items);
+	cinfo->need_quote = need_quote;
+}
+
+void
+pydateToCString(PyObject *pyobject, StringInfo buffer,
+				ConversionInfo * cinfo)
+{
+	char	   *tempbuffer;
+	Py_ssize_t	strlength = 0;
+	PyObject   *formatted_date;
+
+	formatted_date = PyObject_CallMethod(pyobject, "isoformat", "()");
+	PyString_AsStringAndSize(formatted_date, &tempbuffer, &strlength);
+	appendBinaryStringInfo(buffer, tempbuffer, strlength);
+	Py_DECREF(formatted_date);
+}
+
+
+void
+pyobjectToCString(PyObject *pyobject, StringInfo buffer,
+				  ConversionInfo * cinfo)
+{
+	if (pyobject == NULL || pyobject == Py_None)
+	{
+		return;
+	}
+	if (PyNumber_Check(pyobject))
+	{
+		pynumberToCString(pyobject, buffer, cinfo);
+		return;
+	}
+	if (PyUnicode_Check(pyobject))
+	{
+		pyunicodeToCString(pyobject, buffer, cinfo);
+		return;
+	}
+	if (PyBytes_Check(pyobject))
+	{
+		pystringToCString(pyobject, buffer, cinfo);
+		return;
+	}
+	if (PySequence_Check(pyobject))
+	{
+		pysequenceToCString(pyobject, buffer, cinfo);
+		return;
+	}
+	if (PyMapping_Check(pyobject))
+	{
+		pymappingToCString(pyobject, buffer, cinfo);
+		return;
+	}
+	importDateTime();
+	if (PyDate_Check(pyobject))
+	{
+		pydateToCString(pyobject, buffer, cinfo);
+		return;
+	}
+	pyunknownToCstring(pyobject, buffer, cinfo);
+}
+
+void
+pyunknownToCstring(PyObject *pyobject, StringInfo buffer,
+				   ConversionInfo * cinfo)
+{
+	PyObject   *pTempStr = PyObject_Str(pyobject);
+	char	   *tempbuffer;
+	Py_ssize_t	strlength;
+
+	PyString_AsStringAndSize(pTempStr, &tempbuffer, &strlength);
+	errorCheck();
+	appendBinaryStringInfoQuote(buffer, tempbuffer, strlength, cinfo->need_quote);
+	Py_DECREF(pTempStr);
+	return;
+}
+
+/*
+ * Prepare the decoding of the dicts returned by a scan: the column names
+ * are interned once as python keys, and the columns missing from the
+ * target list are marked to be skipped.
+ */
+void
+initColumnKeys(ConversionInfo ** cinfos, int natts, List *target_list)
+{
+	int			i;
+	ListCell   *lc;
+
+	for (i = 0; i < natts; i++)
+	{
+		ConversionInfo *cinfo = cinfos[i];
+
+		if (cinfo == NULL)
+		{
+			continue;
+		}
+#if PY_MAJOR_VERSION >= 3
+		cinfo->attrkey = PyUnicode_InternFromString(cinfo->attrname);
+#else
+		cinfo->attrkey = PyString_InternFromString(cinfo->attrname);
+#endif
+		errorCheck();
+		cinfo->attskip = true;
+		foreach(lc, target_list)
+		{
+			if (strcmp(strVal(lfirst(lc)), cinfo->attrname) == 0)
+			{
+				cinfo->attskip = false;
+				break;
+			}
+		}
+	}
+}
+
+void
+freeColumnKeys(ConversionInfo ** cinfos, int natts)
+{
+	int			i;
+
+	for (i = 0; i < natts; i++)
+	{
+		if (cinfos[i] != NULL)
+		{
+			Py_XDECREF(cinfos[i]->attrkey);
+			cinfos[i]->attrkey = NULL;
+		}
+	}
+}
+
+void
+pythonDictToTuple(PyObject *p_value,
+				  TupleTableSlot *slot,
+				  ConversionInfo ** cinfos,
+				  StringInfo buffer)
+{
+	int			i;
+	PyObject   *p_object;
+	Datum	   *values = slot->tts_values;
+	bool	   *nulls = slot->tts_isnull;
+	bool		exact = PyDict_CheckExact(p_value);
+
+	for (i = 0; i < slot->tts_tupleDescriptor->natts; i++)
+	{
+		char	   *key;
+		Form_pg_attribute attr = TupleDescAttr(slot->tts_tupleDescriptor,i);
+		AttrNumber	cinfo_idx = attr->attnum - 1;
+
+		if (cinfos[cinfo_idx] == NULL || cinfos[cinfo_idx]->attskip)
+		{
+			values[i] = (Datum) NULL;
+			nulls[i] = true; 
+			continue;
+		}
+		if (exact && cinfos[cinfo_idx]->attrkey != NULL)
+		{
+			/* A borrowed reference, and no KeyError to clear. */
+			p_object = PyDict_GetItem(p_value, cinfos[cinfo_idx]->attrkey);
+			Py_XINCREF(p_object);
+		}
+		else
+		{
+			key = cinfos[cinfo_idx]->attrname;
+			p_object = PyMapping_GetItemString(p_value, key);
+		}
+		if (p_object != NULL && p_object != Py_None)
+		{
+			resetStringInfo(buffer);
+			values[i] = pyobjectToDatum(p_object,
+										buffer,
+										cinfos[cinfo_idx]);
+			if (buffer->data == NULL)
+			{
+				nulls[i] = true;
+			}
+			else
+			{
+				nulls[i] = false;
+			}
+		}
+		else
+		{
+			/* "KeyError", doesnt matter. */
+			PyErr_Clear();
+			values[i] = (Datum) NULL;
+			nulls[i] = true;
+		}
+		Py_XDECREF(p_object);
 	}
-	appendBinaryStringInfoQuote(buffer, tempbuffer, strlength, cinfo->need_quote);
 }
 
 void
-pysequenceToCString(PyObject *pyobject, StringInfo buffer,
-					ConversionInfo * cinfo)
+pythonSequenceToTuple(PyObject *p_value,
+					  TupleTableSlot *slot,
+					  ConversionInfo ** cinfos,
+					  StringInfo buffer)
+{
+	int			i,
+				j;
+	Datum	   *values = slot->tts_values;
+	bool	   *nulls = slot->tts_isnull;
+
+	for (i = 0, j = 0; i < slot->tts_tupleDescriptor->natts; i++)
+	{
+		PyObject   *p_object;
+		Form_pg_attribute attr = TupleDescAttr(slot->tts_tupleDescriptor,i);
+		AttrNumber	cinfo_idx = attr->attnum - 1;
+
+		if (cinfos[cinfo_idx] == NULL)
+		{
+			continue;
+		}
+		if (cinfos[cinfo_idx]->attskip)
+		{
+			/* Not needed by the scan, don't even convert it. */
+			values[i] = (Datum) NULL;
+			nulls[i] = true;
+			j++;
+			continue;
+		}
+		p_object = PySequence_GetItem(p_value, j);
+		if(p_object == NULL || p_object == Py_None){
+			nulls[i] = true;
+			values[i] = 0;
+		}
+		else
+		{
+			resetStringInfo(buffer);
+			values[i] = pyobjectToDatum(p_object, buffer,
+										cinfos[cinfo_idx]);
+			if (buffer->data == NULL)
+			{
+				nulls[i] = true;
+			}
+			else
+			{
+				nulls[i] = false;
+			}
+		}
+		errorCheck();
+		Py_DECREF(p_object);
+		j++;
+	}
+}
+
+/*
+ * FDWs with a true projected_sequences attribute return sequences holding
+ * only the columns the scan needs, in table order.  Remember which
+ * attribute each item goes to.
+ */
+void
+initProjection(MulticornExecState * state, int natts)
+{
+	PyObject   *p_projected = PyObject_GetAttrString(state->fdw_instance,
+													 "projected_sequences");
+	int			i;
+
+	if (p_projected == NULL)
+	{
+		/* Not inheriting from ForeignDataWrapper */
+		PyErr_Clear();
+		return;
+	}
+	if (PyObject_IsTrue(p_projected) == 1)
+	{
+		state->projection = palloc(sizeof(int) * natts);
+		state->projection_len = 0;
+		for (i = 0; i < natts; i++)
+		{
+			if (state->cinfos[i] != NULL && !state->cinfos[i]->attskip)
+			{
+				state->projection[state->projection_len++] = i;
+			}
+		}
+	}
+	Py_DECREF(p_projected);
+	errorCheck();
+}
+
+static void
+pythonProjectedSequenceToTuple(PyObject *p_value,
+							   TupleTableSlot *slot,
+							   MulticornExecState * state)
+{
+	int			i;
+	Datum	   *values = slot->tts_values;
+	bool	   *nulls = slot->tts_isnull;
+	Py_ssize_t	size = PySequence_Size(p_value);
+
+	errorCheck();
+	if (size != state->projection_len)
+	{
+		ereport(ERROR,
+				(errmsg("Returned a sequence of %d values instead of %d",
+						(int) size, state->projection_len),
+				 errhint("With projected_sequences set, the sequences must hold "
+						 "the requested columns only, in the order they are "
+						 "given to execute.")));
+	}
+	for (i = 0; i < slot->tts_tupleDescriptor->natts; i++)
+	{
+		values[i] = (Datum) NULL;
+		nulls[i] = true;
+	}
+	for (i = 0; i < state->projection_len; i++)
+	{
+		int			attidx = state->projection[i];
+		PyObject   *p_object = PySequence_GetItem(p_value, i);
+
+		if (p_object != NULL && p_object != Py_None)
+		{
+			resetStringInfo(state->buffer);
+			values[attidx] = pyobjectToDatum(p_object, state->buffer,
+											 state->cinfos[attidx]);
+			nulls[attidx] = (state->buffer->data == NULL);
+		}
+		errorCheck();
+		Py_XDECREF(p_object);
+	}
+}
+
+/*
+ * Convert a row returned by a scan to a tupletableslot.
+ */
+void
+pythonScanResultToTuple(PyObject *p_value,
+						TupleTableSlot *slot,
+						MulticornExecState * state)
+{
+	/* Strings are sequences, but not rows. */
+	if (state->projection != NULL && PySequence_Check(p_value) &&
+		!PyUnicode_Check(p_value) && !PyBytes_Check(p_value))
+	{
+		pythonProjectedSequenceToTuple(p_value, slot, state);
+	}
+	else
+	{
+		pythonResultToTuple(p_value, slot, state->cinfos, state->buffer);
+	}
+}
+
+/*
+ * Convert a python result (a sequence or a dictionary) to a tupletableslot.
+ */
+void
+pythonResultToTuple(PyObject *p_value,
+					TupleTableSlot *slot,
+					ConversionInfo ** cinfos,
+					StringInfo buffer)
+{
+	if (PySequence_Check(p_value))
+	{
+		pythonSequenceToTuple(p_value, slot, cinfos, buffer);
+	}
+	else
+	{
+
+		if (PyMapping_Check(p_value))
+		{
+			pythonDictToTuple(p_value, slot, cinfos, buffer);
+		}
+		else
+		{
+			elog(ERROR, "Cannot transform anything else than mappings and"
+				 "sequences to rows");
+		}
+	}
+}
+
+/*
+ * Get the value of a python integer (but not a boolean) as an int64.
+ * Returns false if the object is not an integer, or if it does not fit.
+ */
+static bool
+pyintegerAsInt64(PyObject *pyobject, int64 *result)
+{
+	long long	value;
+	int			overflow;
+
+#if PY_MAJOR_VERSION < 3
+	if (PyInt_CheckExact(pyobject))
+	{
+		*result = PyInt_AS_LONG(pyobject);
+		return true;
+	}
+#endif
+	if (!PyLong_CheckExact(pyobject))
+	{
+		return false;
+	}
+	value = PyLong_AsLongLongAndOverflow(pyobject, &overflow);
+	if (overflow != 0 || (value == -1 && PyErr_Occurred()))
+	{
+		PyErr_Clear();
+		return false;
+	}
+	*result = (int64) value;
+	return true;
+}
+
+/*
+ * Get the value of a python float, or integer, as a double.
+ */
+static bool
+pyfloatAsDouble(PyObject *pyobject, double *result)
+{
+	int64		ivalue;
+
+	if (PyFloat_CheckExact(pyobject))
+	{
+		*result = PyFloat_AS_DOUBLE(pyobject);
+		return true;
+	}
+	if (pyintegerAsInt64(pyobject, &ivalue))
+	{
+		*result = (double) ivalue;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Converters from python objects straight to the binary representation of
+ * a column type, without formatting them to text and parsing them back.
+ * They only accept the python types they know about, and return false
+ * for anything else, or when the value is out of range: the generic text
+ * path then takes over, and the input function reports any error.
+ */
+static bool
+pyboolToDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	if (!PyBool_Check(pyobject))
+		return false;
+	*value = BoolGetDatum(pyobject == Py_True);
+	return true;
+}
+
+static bool
+pyint2ToDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	int64		ivalue;
+
+	if (!pyintegerAsInt64(pyobject, &ivalue) ||
+		ivalue < SHRT_MIN || ivalue > SHRT_MAX)
+		return false;
+	*value = Int16GetDatum((int16) ivalue);
+	return true;
+}
+
+static bool
+pyint4ToDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	int64		ivalue;
+
+	if (!pyintegerAsInt64(pyobject, &ivalue) ||
+		ivalue < INT_MIN || ivalue > INT_MAX)
+		return false;
+	*value = Int32GetDatum((int32) ivalue);
+	return true;
+}
+
+static bool
+pyint8ToDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	int64		ivalue;
+
+	if (!pyintegerAsInt64(pyobject, &ivalue))
+		return false;
+	*value = Int64GetDatum(ivalue);
+	return true;
+}
+
+static bool
+pyfloat4ToDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	double		dvalue;
+	float4		fvalue;
+
+	if (!pyfloatAsDouble(pyobject, &dvalue))
+		return false;
+	fvalue = (float4) dvalue;
+	/* Let float4in complain about overflows and underflows. */
+	if ((isinf(fvalue) && !isinf(dvalue)) ||
+		(fvalue == 0.0 && dvalue != 0.0))
+		return false;
+	*value = Float4GetDatum(fvalue);
+	return true;
+}
+
+static bool
+pyfloat8ToDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	double		dvalue;
+
+	if (!pyfloatAsDouble(pyobject, &dvalue))
+		return false;
+	*value = Float8GetDatum(dvalue);
+	return true;
+}
+
+static bool
+pyunicodeToTextDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	PyObject   *p_encoded;
+	const char *str;
+	Py_ssize_t	size;
+
+	if (!PyUnicode_CheckExact(pyobject))
+		return false;
+	str = pyunicodeAsPgBytes(pyobject, &size, &p_encoded);
+	if (str == NULL)
+	{
+		/* The generic path reports the error. */
+		PyErr_Clear();
+		return false;
+	}
+	*value = PointerGetDatum(cstring_to_text_with_len(str, size));
+	Py_XDECREF(p_encoded);
+	return true;
+}
+
+/*
+ * Bytes, bytearrays and any other object exposing a contiguous buffer, such
+ * as memoryviews, are copied once, straight into the bytea.
+ */
+static bool
+pybytesToByteaDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	Py_buffer	view;
+
+	if (PyBytes_CheckExact(pyobject))
+	{
+		*value = PointerGetDatum(cstring_to_text_with_len(PyBytes_AS_STRING(pyobject),
+														  PyBytes_GET_SIZE(pyobject)));
+		return true;
+	}
+	if (PyUnicode_Check(pyobject) || !PyObject_CheckBuffer(pyobject))
+		return false;
+	if (PyObject_GetBuffer(pyobject, &view, PyBUF_CONTIG_RO) < 0)
+	{
+		PyErr_Clear();
+		return false;
+	}
+	*value = PointerGetDatum(cstring_to_text_with_len(view.buf, view.len));
+	PyBuffer_Release(&view);
+	return true;
+}
+
+/*
+ * Call a predicate method of a decimal, such as is_qnan.
+ */
+static bool
+pydecimalIs(PyObject *pyobject, const char *method)
+{
+	PyObject   *p_result = PyObject_CallMethod(pyobject, (char *) method, "()");
+	bool		result = false;
+
+	if (p_result != NULL)
+	{
+		result = PyObject_IsTrue(p_result) == 1;
+		Py_DECREF(p_result);
+	}
+	PyErr_Clear();
+	return result;
+}
+
+/*
+ * Write a decimal in the form numeric_in expects.  Its str() already is for
+ * finite values, and is much cheaper to get than its as_tuple().  Quiet
+ * NaNs are written as NaN whatever their sign, and infinities as such.
+ * Returns false for the values numeric_in can't represent, such as
+ * signaling NaNs, which are left to the generic conversion.
+ */
+static bool
+pydecimalToCString(PyObject *pyobject, StringInfo buffer)
+{
+	PyObject   *p_str;
+	char	   *str;
+	Py_ssize_t	strlength = 0;
+	char		first;
+	bool		result = true;
+
+	p_str = PyObject_Str(pyobject);
+	if (p_str == NULL)
+	{
+		PyErr_Clear();
+		return false;
+	}
+	/* Decimals are written in ascii, no need to recode them */
+#if PY_MAJOR_VERSION >= 3
+	str = (char *) PyUnicode_AsUTF8AndSize(p_str, &strlength);
+#else
+	PyString_AsStringAndSize(p_str, &str, &strlength);
+#endif
+	first = str[0] == '-' ? str[1] : str[0];
+	if (first >= '0' && first <= '9')
+		appendBinaryStringInfo(buffer, str, strlength);
+	else if (pydecimalIs(pyobject, "is_qnan"))
+		appendStringInfoString(buffer, "NaN");
+	else if (pydecimalIs(pyobject, "is_infinite"))
+		appendBinaryStringInfo(buffer, str, strlength);
+	else
+		result = false;
+	Py_DECREF(p_str);
+	return result;
+}
+
+/*
+ * Integers are converted exactly, and decimals are written from their str()
+ * for numeric_in, without going through the generic conversion.
+ * Everything else, floats included, goes through str() and numeric_in.
+ */
+static bool
+pynumberToNumericDatum(PyObject *pyobject, ConversionInfo * cinfo,
+					   Datum *value)
 {
-	/* Its an array */
-	Py_ssize_t	i,
-				size = PySequence_Size(pyobject);
-	PyObject   *p_item;
-	int			previous_dims = cinfo->attndims,
-				previous_needquote = cinfo->need_quote;
+	int64		ivalue;
+	StringInfoData buffer;
 
-	if (cinfo->attndims == 0)
+	if (pyintegerAsInt64(pyobject, &ivalue))
 	{
-		/* We are not supposed to be converted to an array. */
-		pyunknownToCstring(pyobject, buffer, cinfo);
-		return;
+		*value = DirectFunctionCall1(int8_numeric, Int64GetDatum(ivalue));
+		if (cinfo->atttypmod >= 0)
+			*value = DirectFunctionCall2(numeric, *value,
+										 Int32GetDatum(cinfo->atttypmod));
+		return true;
 	}
-	appendStringInfoChar(buffer, '{');
-	/* We are an array, so we need to quote stuff */
-	cinfo->need_quote = true;
-	cinfo->attndims = cinfo->attndims - 1;
-	for (i = 0; i < size; i++)
+	if (decimalClass == NULL ||
+		!PyObject_TypeCheck(pyobject, (PyTypeObject *) decimalClass))
+		return false;
+	initStringInfo(&buffer);
+	if (!pydecimalToCString(pyobject, &buffer))
 	{
-		p_item = PySequence_GetItem(pyobject, i);
-		pyobjectToCString(p_item, buffer, cinfo);
-		Py_DECREF(p_item);
-		if (i != size - 1)
-		{
-			appendBinaryStringInfo(buffer, ", ", 2);
-		}
+		pfree(buffer.data);
+		return false;
 	}
-	appendStringInfoChar(buffer, '}');
-	cinfo->attndims = previous_dims;
-	cinfo->need_quote = previous_needquote;
+	*value = DirectFunctionCall3(numeric_in, CStringGetDatum(buffer.data),
+								 ObjectIdGetDatum(InvalidOid),
+								 Int32GetDatum(cinfo->atttypmod));
+	pfree(buffer.data);
+	return true;
 }
 
-void
-pymappingToCString(PyObject *pyobject, StringInfo buffer,
-				   ConversionInfo * cinfo)
+/*
+ * UUIDs are copied from their 16 bytes.
+ */
+static bool
+pyuuidToUuidDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	PyObject   *p_bytes;
+	pg_uuid_t  *uuid;
+
+	if (uuidClass == NULL ||
+		!PyObject_TypeCheck(pyobject, (PyTypeObject *) uuidClass))
+		return false;
+	p_bytes = PyObject_GetAttrString(pyobject, "bytes");
+	if (p_bytes == NULL)
+	{
+		PyErr_Clear();
+		return false;
+	}
+	if (!PyBytes_Check(p_bytes) || PyBytes_GET_SIZE(p_bytes) != UUID_LEN)
+	{
+		Py_DECREF(p_bytes);
+		return false;
+	}
+	uuid = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+	memcpy(uuid->data, PyBytes_AS_STRING(p_bytes), UUID_LEN);
+	Py_DECREF(p_bytes);
+	*value = UUIDPGetDatum(uuid);
+	return true;
+}
+
+/*
+ * Converts an array element, with the element type converter when there is
+ * one, and its input function otherwise.
+ */
+static Datum
+pyobjectToElementDatum(PyObject *pyobject, ConversionInfo * elemcinfo,
+					   StringInfo buffer)
+{
+	Datum		value;
+
+	if (elemcinfo->pytodatum != NULL &&
+		elemcinfo->pytodatum(pyobject, elemcinfo, &value))
+		return value;
+	resetStringInfo(buffer);
+	pyobjectToCString(pyobject, buffer, elemcinfo);
+	return InputFunctionCall(elemcinfo->attinfunc, buffer->data,
+							 elemcinfo->attioparam, elemcinfo->atttypmod);
+}
+
+/*
+ * Converts the items of a (possibly nested) list or tuple into elements,
+ * checking that it has the dimensions found on the first items.
+ */
+static bool
+pysequenceToElements(PyObject *pyobject, int dim, int ndims, int *dims,
+					 ConversionInfo * elemcinfo, Datum *elems, bool *nulls,
+					 int *nelems, StringInfo buffer)
 {
-	PyObject   *items = PyMapping_Items(pyobject);
-	PyObject   *current_tuple;
 	Py_ssize_t	i;
-	Py_ssize_t	size = PyList_Size(items);
-	bool		need_quote = cinfo->need_quote;
 
-	cinfo->need_quote = true;
-	for (i = 0; i < size; i++)
+	if (!(PyList_Check(pyobject) || PyTuple_Check(pyobject)) ||
+		PySequence_Fast_GET_SIZE(pyobject) != dims[dim])
+		return false;
+	for (i = 0; i < dims[dim]; i++)
 	{
-		current_tuple = PySequence_GetItem(items, i);
-		pyobjectToCString(PyTuple_GetItem(current_tuple, 0),
-						  buffer, cinfo);
-		appendBinaryStringInfo(buffer, "=>", 2);
-		pyobjectToCString(PyTuple_GetItem(current_tuple, 1),
-						  buffer, cinfo);
-		if (i != size - 1)
+		PyObject   *p_item = PySequence_Fast_GET_ITEM(pyobject, i);
+
+		if (dim < ndims - 1)
 		{
-			appendBinaryStringInfo(buffer, ", ", 2);
+			if (!pysequenceToElements(p_item, dim + 1, ndims, dims, elemcinfo,
+									  elems, nulls, nelems, buffer))
+				return false;
+		}
+		else if (p_item == Py_None)
+		{
+			elems[*nelems] = (Datum) 0;
+			nulls[(*nelems)++] = true;
+		}
+		else if (PyList_Check(p_item) || PyTuple_Check(p_item))
+		{
+			/* Deeper than the column: let the text path stringify it. */
+			return false;
+		}
+		else
+		{
+			elems[*nelems] = pyobjectToElementDatum(p_item, elemcinfo, buffer);
+			nulls[(*nelems)++] = false;
 		}
-		Py_DECREF(current_tuple);
 	}
-	Py_DECREF(items);
-	cinfo->need_quote = need_quote;
+	return true;
 }
 
-void
-pydateToCString(PyObject *pyobject, StringInfo buffer,
-				ConversionInfo * cinfo)
+/*
+ * Builds an array from a list or tuple, nested up to the number of
+ * dimensions of the column.  Sequences of uneven lengths go through
+ * array_in, which reports the error.
+ */
+static bool
+pysequenceToArrayDatum(PyObject *pyobject, ConversionInfo * cinfo,
+					   Datum *value)
 {
-	char	   *tempbuffer;
-	Py_ssize_t	strlength = 0;
-	PyObject   *formatted_date;
+	ConversionInfo *elemcinfo = cinfo->elemcinfo;
+	int			maxdims = Min(cinfo->attndims, MAXDIM);
+	int			ndims = 0;
+	int			dims[MAXDIM];
+	int			lbs[MAXDIM];
+	int			nitems = 1;
+	int			nelems = 0;
+	Datum	   *elems;
+	bool	   *nulls;
+	PyObject   *p_current = pyobject;
+	StringInfoData buffer;
+
+	if (elemcinfo == NULL ||
+		!(PyList_Check(pyobject) || PyTuple_Check(pyobject)))
+		return false;
+	/* Guess the dimensions from the first item at each level. */
+	while (ndims < maxdims &&
+		   (PyList_Check(p_current) || PyTuple_Check(p_current)))
+	{
+		dims[ndims] = PySequence_Fast_GET_SIZE(p_current);
+		lbs[ndims] = 1;
+		nitems *= dims[ndims];
+		if (dims[ndims++] == 0)
+			break;
+		p_current = PySequence_Fast_GET_ITEM(p_current, 0);
+	}
+	if (nitems == 0)
+	{
+		if (ndims > 1)
+			return false;
+		*value = PointerGetDatum(construct_empty_array(elemcinfo->atttypoid));
+		return true;
+	}
+	elems = palloc(sizeof(Datum) * nitems);
+	nulls = palloc(sizeof(bool) * nitems);
+	initStringInfo(&buffer);
+	if (!pysequenceToElements(pyobject, 0, ndims, dims, elemcinfo,
+							  elems, nulls, &nelems, &buffer))
+	{
+		pfree(elems);
+		pfree(nulls);
+		pfree(buffer.data);
+		return false;
+	}
+	*value = PointerGetDatum(construct_md_array(elems, nulls, ndims, dims, lbs,
+												elemcinfo->atttypoid,
+												cinfo->elmlen,
+												cinfo->elmbyval,
+												cinfo->elmalign));
+	pfree(elems);
+	pfree(nulls);
+	pfree(buffer.data);
+	return true;
+}
 
-	formatted_date = PyObject_CallMethod(pyobject, "isoformat", "()");
-	PyString_AsStringAndSize(formatted_date, &tempbuffer, &strlength);
-	appendBinaryStringInfo(buffer, tempbuffer, strlength);
-	Py_DECREF(formatted_date);
+/*
+ * Gets a python string in the database encoding.  Returns false if the
+ * object is not a string, cannot be encoded, or holds a NUL character.
+ */
+static bool
+pystringAsPgString(PyObject *pyobject, char **str, int *len)
+{
+	PyObject   *p_encoded;
+	const char *bytes;
+	Py_ssize_t	size;
+
+	if (PyUnicode_Check(pyobject))
+	{
+		bytes = pyunicodeAsPgBytes(pyobject, &size, &p_encoded);
+		if (bytes == NULL)
+		{
+			PyErr_Clear();
+			return false;
+		}
+	}
+#if PY_MAJOR_VERSION < 3
+	else if (PyBytes_Check(pyobject))
+	{
+		p_encoded = NULL;
+		bytes = PyBytes_AS_STRING(pyobject);
+		size = PyBytes_GET_SIZE(pyobject);
+	}
+#endif
+	else
+	{
+		return false;
+	}
+	/* Text cannot hold them, and escape_json would stop at the first one */
+	if (memchr(bytes, '\0', size) != NULL)
+	{
+		Py_XDECREF(p_encoded);
+		return false;
+	}
+	*len = size;
+	*str = pnstrdup(bytes, size);
+	Py_XDECREF(p_encoded);
+	return true;
 }
 
+/*
+ * Formats a float, or an integer too large for an int64, the way json.dumps
+ * does.  Returns NULL for anything else, including infinites and NaNs.
+ */
+static char *
+pynumberAsJsonCString(PyObject *pyobject)
+{
+	PyObject   *p_str;
+	char	   *result;
+
+	if (PyFloat_CheckExact(pyobject))
+	{
+		double		dvalue = PyFloat_AS_DOUBLE(pyobject);
 
-void
-pyobjectToCString(PyObject *pyobject, StringInfo buffer,
-				  ConversionInfo * cinfo)
+		if (isinf(dvalue) || isnan(dvalue))
+			return NULL;
+		p_str = PyObject_Repr(pyobject);
+	}
+	else if (PyLong_CheckExact(pyobject))
+	{
+		p_str = PyObject_Str(pyobject);
+	}
+	else
+	{
+		return NULL;
+	}
+	if (p_str == NULL)
+	{
+		PyErr_Clear();
+		return NULL;
+	}
+	result = pstrdup(PyString_AsString(p_str));
+	Py_DECREF(p_str);
+	return result;
+}
+
+/*
+ * Appends the JSON text of a python value, as json.dumps would write it.
+ * Returns false for values json.dumps would reject.
+ */
+static bool
+pyobjectAppendJson(PyObject *pyobject, StringInfo buffer)
 {
-	if (pyobject == NULL || pyobject == Py_None)
+	char	   *str;
+	int			len;
+	int64		ivalue;
+
+	check_stack_depth();
+	if (pyobject == Py_None)
 	{
-		return;
+		appendStringInfoString(buffer, "null");
 	}
-	if (PyNumber_Check(pyobject))
+	else if (PyBool_Check(pyobject))
 	{
-		pynumberToCString(pyobject, buffer, cinfo);
-		return;
+		appendStringInfoString(buffer,
+							   pyobject == Py_True ? "true" : "false");
 	}
-	if (PyUnicode_Check(pyobject))
+	else if (pystringAsPgString(pyobject, &str, &len))
 	{
-		pyunicodeToCString(pyobject, buffer, cinfo);
-		return;
+		escape_json(buffer, str);
+		pfree(str);
 	}
-	if (PyBytes_Check(pyobject))
+	else if (pyintegerAsInt64(pyobject, &ivalue))
 	{
-		pystringToCString(pyobject, buffer, cinfo);
-		return;
+		appendStringInfo(buffer, INT64_FORMAT, ivalue);
 	}
-	if (PySequence_Check(pyobject))
+	else if ((str = pynumberAsJsonCString(pyobject)) != NULL)
 	{
-		pysequenceToCString(pyobject, buffer, cinfo);
-		return;
+		appendStringInfoString(buffer, str);
+		pfree(str);
 	}
-	if (PyMapping_Check(pyobject))
+	else if (PyDict_Check(pyobject))
 	{
-		pymappingToCString(pyobject, buffer, cinfo);
-		return;
+		Py_ssize_t	pos = 0;
+		PyObject   *p_key,
+				   *p_value;
+		bool		first = true;
+
+		appendStringInfoChar(buffer, '{');
+		while (PyDict_Next(pyobject, &pos, &p_key, &p_value))
+		{
+			if (!first)
+				appendBinaryStringInfo(buffer, ", ", 2);
+			first = false;
+			if (!pystringAsPgString(p_key, &str, &len))
+				return false;
+			escape_json(buffer, str);
+			pfree(str);
+			appendBinaryStringInfo(buffer, ": ", 2);
+			if (!pyobjectAppendJson(p_value, buffer))
+				return false;
+		}
+		appendStringInfoChar(buffer, '}');
 	}
-	PyDateTime_IMPORT;
-	if (PyDate_Check(pyobject))
+	else if (PyList_Check(pyobject) || PyTuple_Check(pyobject))
 	{
-		pydateToCString(pyobject, buffer, cinfo);
-		return;
+		Py_ssize_t	i;
+
+		appendStringInfoChar(buffer, '[');
+		for (i = 0; i < PySequence_Fast_GET_SIZE(pyobject); i++)
+		{
+			if (i > 0)
+				appendBinaryStringInfo(buffer, ", ", 2);
+			if (!pyobjectAppendJson(PySequence_Fast_GET_ITEM(pyobject, i),
+									buffer))
+				return false;
+		}
+		appendStringInfoChar(buffer, ']');
 	}
-	pyunknownToCstring(pyobject, buffer, cinfo);
+	else
+	{
+		return false;
+	}
+	return true;
 }
 
-void
-pyunknownToCstring(PyObject *pyobject, StringInfo buffer,
-				   ConversionInfo * cinfo)
+/*
+ * Dicts, lists and tuples are written as JSON text.  Strings are left to
+ * json_in, since they usually already hold JSON text.
+ */
+static bool
+pyobjectToJsonDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
 {
-	PyObject   *pTempStr = PyObject_Str(pyobject);
-	char	   *tempbuffer;
-	Py_ssize_t	strlength;
+	StringInfoData buffer;
 
-	PyString_AsStringAndSize(pTempStr, &tempbuffer, &strlength);
-	errorCheck();
-	appendBinaryStringInfoQuote(buffer, tempbuffer, strlength, cinfo->need_quote);
-	Py_DECREF(pTempStr);
-	return;
+	if (!(PyDict_Check(pyobject) || PyList_Check(pyobject) ||
+		  PyTuple_Check(pyobject)))
+		return false;
+	initStringInfo(&buffer);
+	if (!pyobjectAppendJson(pyobject, &buffer))
+	{
+		pfree(buffer.data);
+		return false;
+	}
+	*value = PointerGetDatum(cstring_to_text_with_len(buffer.data,
+													  buffer.len));
+	pfree(buffer.data);
+	return true;
 }
 
-void
-pythonDictToTuple(PyObject *p_value,
-				  TupleTableSlot *slot,
-				  ConversionInfo ** cinfos,
-				  StringInfo buffer)
+#if PG_VERSION_NUM >= 90400
+/*
+ * Pushes a python value to a jsonb being built, as a value of the given
+ * token kind.  Containers replace *result with the finished container.
+ */
+static bool
+pyobjectPushJsonb(PyObject *pyobject, JsonbParseState **state, int token,
+				  JsonbValue **result)
 {
-	int			i;
-	PyObject   *p_object;
-	Datum	   *values = slot->tts_values;
-	bool	   *nulls = slot->tts_isnull;
+	JsonbValue	jbvalue;
+	int64		ivalue;
+	char	   *str;
+	int			len;
 
-	for (i = 0; i < slot->tts_tupleDescriptor->natts; i++)
+	check_stack_depth();
+	if (PyDict_Check(pyobject))
 	{
-		char	   *key;
-		Form_pg_attribute attr = TupleDescAttr(slot->tts_tupleDescriptor,i);
-		AttrNumber	cinfo_idx = attr->attnum - 1;
+		Py_ssize_t	pos = 0;
+		PyObject   *p_key,
+				   *p_value;
 
-		if (cinfos[cinfo_idx] == NULL)
-		{
-			values[i] = (Datum) NULL;
-			nulls[i] = true; 
-			continue;
-		}
-		key = cinfos[cinfo_idx]->attrname;
-		p_object = PyMapping_GetItemString(p_value, key);
-		if (p_object != NULL && p_object != Py_None)
+		pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+		while (PyDict_Next(pyobject, &pos, &p_key, &p_value))
 		{
-			resetStringInfo(buffer);
-			values[i] = pyobjectToDatum(p_object,
-										buffer,
-										cinfos[cinfo_idx]);
-			if (buffer->data == NULL)
-			{
-				nulls[i] = true;
-			}
-			else
-			{
-				nulls[i] = false;
-			}
+			if (!pystringAsPgString(p_key, &str, &len))
+				return false;
+			jbvalue.type = jbvString;
+			jbvalue.val.string.val = str;
+			jbvalue.val.string.len = len;
+			pushJsonbValue(state, WJB_KEY, &jbvalue);
+			if (!pyobjectPushJsonb(p_value, state, WJB_VALUE, result))
+				return false;
 		}
-		else
+		*result = pushJsonbValue(state, WJB_END_OBJECT, NULL);
+		return true;
+	}
+	if (PyList_Check(pyobject) || PyTuple_Check(pyobject))
+	{
+		Py_ssize_t	i;
+
+		pushJsonbValue(state, WJB_BEGIN_ARRAY, NULL);
+		for (i = 0; i < PySequence_Fast_GET_SIZE(pyobject); i++)
 		{
-			/* "KeyError", doesnt matter. */
-			PyErr_Clear();
-			values[i] = (Datum) NULL;
-			nulls[i] = true;
+			if (!pyobjectPushJsonb(PySequence_Fast_GET_ITEM(pyobject, i),
+								   state, WJB_ELEM, result))
+				return false;
 		}
-		Py_XDECREF(p_object);
+		*result = pushJsonbValue(state, WJB_END_ARRAY, NULL);
+		return true;
+	}
+	if (pyobject == Py_None)
+	{
+		jbvalue.type = jbvNull;
+	}
+	else if (PyBool_Check(pyobject))
+	{
+		jbvalue.type = jbvBool;
+		jbvalue.val.boolean = (pyobject == Py_True);
+	}
+	else if (pystringAsPgString(pyobject, &str, &len))
+	{
+		jbvalue.type = jbvString;
+		jbvalue.val.string.val = str;
+		jbvalue.val.string.len = len;
+	}
+	else if (pyintegerAsInt64(pyobject, &ivalue))
+	{
+		jbvalue.type = jbvNumeric;
+		jbvalue.val.numeric = DatumGetNumeric(DirectFunctionCall1(int8_numeric,
+													Int64GetDatum(ivalue)));
+	}
+	else if ((str = pynumberAsJsonCString(pyobject)) != NULL)
+	{
+		jbvalue.type = jbvNumeric;
+		jbvalue.val.numeric = DatumGetNumeric(DirectFunctionCall3(numeric_in,
+													CStringGetDatum(str),
+										  ObjectIdGetDatum(InvalidOid),
+													Int32GetDatum(-1)));
+		pfree(str);
+	}
+	else
+	{
+		return false;
 	}
+	pushJsonbValue(state, token, &jbvalue);
+	return true;
 }
 
-void
-pythonSequenceToTuple(PyObject *p_value,
-					  TupleTableSlot *slot,
-					  ConversionInfo ** cinfos,
-					  StringInfo buffer)
+/*
+ * Dicts, lists and tuples are built into a jsonb directly.  Strings are left
+ * to jsonb_in, since they usually already hold JSON text.
+ */
+static bool
+pyobjectToJsonbDatum(PyObject *pyobject, ConversionInfo * cinfo,
+					 Datum *value)
 {
-	int			i,
-				j;
-	Datum	   *values = slot->tts_values;
-	bool	   *nulls = slot->tts_isnull;
+	JsonbParseState *state = NULL;
+	JsonbValue *result = NULL;
 
-	for (i = 0, j = 0; i < slot->tts_tupleDescriptor->natts; i++)
+	if (!(PyDict_Check(pyobject) || PyList_Check(pyobject) ||
+		  PyTuple_Check(pyobject)))
+		return false;
+	if (!pyobjectPushJsonb(pyobject, &state, WJB_VALUE, &result))
+		return false;
+	*value = PointerGetDatum(JsonbValueToJsonb(result));
+	return true;
+}
+#endif
+
+/*
+ * Gets an hstore key or value: strings as they are, and other scalars
+ * formatted with str(), like pyobjectToCString does.
+ */
+static bool
+pyobjectAsHstoreString(PyObject *pyobject, char **str, int *len)
+{
+	PyObject   *p_str;
+	bool		result;
+
+	if (pystringAsPgString(pyobject, str, len))
+		return true;
+	importDateTime();
+	if (pyobject == Py_None || PyDict_Check(pyobject) ||
+		PySequence_Check(pyobject) || PyDate_Check(pyobject))
+		return false;
+	p_str = PyObject_Str(pyobject);
+	if (p_str == NULL)
 	{
-		PyObject   *p_object;
-		Form_pg_attribute attr = TupleDescAttr(slot->tts_tupleDescriptor,i);
-		AttrNumber	cinfo_idx = attr->attnum - 1;
+		PyErr_Clear();
+		return false;
+	}
+	result = pystringAsPgString(p_str, str, len);
+	Py_DECREF(p_str);
+	return result;
+}
 
-		if (cinfos[cinfo_idx] == NULL)
-		{
-			continue;
-		}
-		p_object = PySequence_GetItem(p_value, j);
-		if(p_object == NULL || p_object == Py_None){
-			nulls[i] = true;
-			values[i] = 0;
-		}
-		else
+/*
+ * Builds an hstore from a dict, with the hstore(text[], text[]) function
+ * found by initConversioninfo.  None values are stored as NULL.
+ */
+bool
+pydictToHstoreDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	Py_ssize_t	pos = 0;
+	PyObject   *p_key,
+			   *p_value;
+	int			size,
+				i = 0;
+	Datum	   *keys,
+			   *values;
+	bool	   *nulls;
+	char	   *str;
+	int			len;
+	int			dims[1];
+	int			lbs[1] = {1};
+	ArrayType  *keysarray,
+			   *valuesarray;
+
+	if (!PyDict_Check(pyobject) || cinfo->hstorefunc == NULL)
+		return false;
+	size = PyDict_Size(pyobject);
+	if (size == 0)
+	{
+		keysarray = construct_empty_array(TEXTOID);
+		valuesarray = construct_empty_array(TEXTOID);
+	}
+	else
+	{
+		keys = palloc(sizeof(Datum) * size);
+		values = palloc(sizeof(Datum) * size);
+		nulls = palloc(sizeof(bool) * size);
+		while (PyDict_Next(pyobject, &pos, &p_key, &p_value))
 		{
-			resetStringInfo(buffer);
-			values[i] = pyobjectToDatum(p_object, buffer,
-										cinfos[cinfo_idx]);
-			if (buffer->data == NULL)
+			if (!pyobjectAsHstoreString(p_key, &str, &len))
+				break;
+			keys[i] = PointerGetDatum(cstring_to_text_with_len(str, len));
+			pfree(str);
+			if (p_value == Py_None)
 			{
+				values[i] = (Datum) 0;
 				nulls[i] = true;
 			}
 			else
 			{
+				if (!pyobjectAsHstoreString(p_value, &str, &len))
+					break;
+				values[i] = PointerGetDatum(cstring_to_text_with_len(str, len));
 				nulls[i] = false;
+				pfree(str);
 			}
+			i++;
 		}
-		errorCheck();
-		Py_DECREF(p_object);
-		j++;
+		if (i < size)
+		{
+			/* A key or value could not be converted */
+			pfree(keys);
+			pfree(values);
+			pfree(nulls);
+			return false;
+		}
+		dims[0] = size;
+		keysarray = construct_md_array(keys, NULL, 1, dims, lbs,
+									   TEXTOID, -1, false, 'i');
+		valuesarray = construct_md_array(values, nulls, 1, dims, lbs,
+										 TEXTOID, -1, false, 'i');
 	}
+	*value = FunctionCall2(cinfo->hstorefunc, PointerGetDatum(keysarray),
+						   PointerGetDatum(valuesarray));
+	return true;
 }
 
 /*
- * Convert a python result (a sequence or a dictionary) to a tupletableslot.
+ * Returns the converter to use for values of the given column type, or
+ * NULL if they always go through the text representation.
  */
-void
-pythonResultToTuple(PyObject *p_value,
-					TupleTableSlot *slot,
-					ConversionInfo ** cinfos,
-					StringInfo buffer)
+PyToDatumFunc
+getPyToDatumFunc(Oid typeoid)
 {
-	if (PySequence_Check(p_value))
+	switch (typeoid)
 	{
-		pythonSequenceToTuple(p_value, slot, cinfos, buffer);
-	}
-	else
-	{
-
-		if (PyMapping_Check(p_value))
-		{
-			pythonDictToTuple(p_value, slot, cinfos, buffer);
-		}
-		else
-		{
-			elog(ERROR, "Cannot transform anything else than mappings and"
-				 "sequences to rows");
-		}
+		case BOOLOID:
+			return pyboolToDatum;
+		case INT2OID:
+			return pyint2ToDatum;
+		case INT4OID:
+			return pyint4ToDatum;
+		case INT8OID:
+			return pyint8ToDatum;
+		case FLOAT4OID:
+			return pyfloat4ToDatum;
+		case FLOAT8OID:
+			return pyfloat8ToDatum;
+		case TEXTOID:
+		case VARCHAROID:
+			return pyunicodeToTextDatum;
+		case BYTEAOID:
+			return pybytesToByteaDatum;
+		case NUMERICOID:
+			importConverterClass(&decimalClass, "decimal.Decimal");
+			return pynumberToNumericDatum;
+		case UUIDOID:
+			importConverterClass(&uuidClass, "uuid.UUID");
+			return pyuuidToUuidDatum;
+		case JSONOID:
+			return pyobjectToJsonDatum;
+#if PG_VERSION_NUM >= 90400
+		case JSONBOID:
+			return pyobjectToJsonbDatum;
+#endif
+#if PG_VERSION_NUM >= 100000
+		case TIMESTAMPOID:
+			importDateTime();
+			return pydatetimeToTimestampDatum;
+		case TIMESTAMPTZOID:
+			importDateTime();
+			return pydatetimeToTimestampTzDatum;
+		case DATEOID:
+			importDateTime();
+			return pydateToDateDatum;
+		case TIMEOID:
+			importDateTime();
+			return pytimeToTimeDatum;
+#endif
+		default:
+			/* Only used once the element conversion is set up. */
+			if (type_is_array(typeoid))
+				return pysequenceToArrayDatum;
+			return NULL;
 	}
 }
 
@@ -1348,6 +3201,10 @@ pyobjectToDatum(PyObject *object, StringInfo buffer,
 {
 	Datum		value = 0;
 
+	if (cinfo->pytodatum != NULL && cinfo->pytodatum(object, cinfo, &value))
+	{
+		return value;
+	}
 	pyobjectToCString(object, buffer,
 					  cinfo);
 
@@ -1387,39 +3244,147 @@ datumStringToPython(Datum datum, ConversionInfo * cinfo)
 	return result;
 }
 
+/*
+ * What datumToPython needs to know about a type it has no native converter
+ * for, looked up once per backend.
+ */
+typedef struct TypeOutputEntry
+{
+	Oid			typeoid;		/* hash key */
+	bool		valid;
+	/* Element type for arrays, InvalidOid otherwise, and its storage */
+	Oid			elemtype;
+	int16		elmlen;
+	bool		elmbyval;
+	char		elmalign;
+	/* Output function, used for the other types */
+	FmgrInfo	outfunc;
+}	TypeOutputEntry;
+
+static HTAB *TypeOutputHash = NULL;
+
+/*
+ * Holds what fmgr_info_cxt allocates for the output functions, such as
+ * their fn_extra caches.  It is reset once every entry has been invalidated.
+ */
+static MemoryContext TypeOutputContext = NULL;
+static bool TypeOutputContextStale = false;
+
+/*
+ * Types can be dropped and their oids reused, so forget everything when
+ * pg_type changes.  This can run while an output function is being called,
+ * so the memory of the output functions is only released by the next
+ * lookup.
+ */
+static void
+invalidateTypeOutputHash(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS status;
+	TypeOutputEntry *entry;
+
+	hash_seq_init(&status, TypeOutputHash);
+	while ((entry = (TypeOutputEntry *) hash_seq_search(&status)) != NULL)
+		entry->valid = false;
+	TypeOutputContextStale = true;
+}
+
+static TypeOutputEntry *
+getTypeOutputEntry(Oid type)
+{
+	TypeOutputEntry *entry;
+	bool		found;
+
+	if (TypeOutputHash == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(TypeOutputEntry);
+		ctl.hash = oid_hash;
+		ctl.hcxt = CacheMemoryContext;
+		TypeOutputHash = hash_create("multicorn type outputs", 64, &ctl,
+									 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+		TypeOutputContext = AllocSetContextCreate(CacheMemoryContext,
+												  "multicorn type outputs",
+												  ALLOCSET_SMALL_MINSIZE,
+												  ALLOCSET_SMALL_INITSIZE,
+												  ALLOCSET_SMALL_MAXSIZE);
+		CacheRegisterSyscacheCallback(TYPEOID, invalidateTypeOutputHash,
+									  (Datum) 0);
+	}
+	if (TypeOutputContextStale)
+	{
+		MemoryContextReset(TypeOutputContext);
+		TypeOutputContextStale = false;
+	}
+	entry = (TypeOutputEntry *) hash_search(TypeOutputHash, &type,
+											HASH_ENTER, &found);
+	if (!found || !entry->valid)
+	{
+		HeapTuple	tuple;
+		Form_pg_type typeStruct;
+		Oid			outfuncoid;
+
+		/* Do not leave a half built entry behind if the lookup fails */
+		entry->valid = false;
+		tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(type));
+		if (!HeapTupleIsValid(tuple))
+		{
+			elog(ERROR, "lookup failed for type %u",
+				 type);
+		}
+		typeStruct = (Form_pg_type) GETSTRUCT(tuple);
+		if ((typeStruct->typelem != 0) && (typeStruct->typlen == -1))
+			entry->elemtype = typeStruct->typelem;
+		else
+			entry->elemtype = InvalidOid;
+		outfuncoid = typeStruct->typoutput;
+		ReleaseSysCache(tuple);
+		if (OidIsValid(entry->elemtype))
+			get_typlenbyvalalign(entry->elemtype, &entry->elmlen,
+								 &entry->elmbyval, &entry->elmalign);
+		fmgr_info_cxt(outfuncoid, &entry->outfunc, TypeOutputContext);
+		entry->valid = true;
+	}
+	return entry;
+}
+
 PyObject *
 datumUnknownToPython(Datum datum, ConversionInfo * cinfo, Oid type)
 {
 	char	   *temp;
 	ssize_t		size;
 	PyObject   *result;
-	Oid			outfuncoid;
-	bool		isvarlena;
-	FmgrInfo   *fmout = palloc0(sizeof(FmgrInfo));
+	TypeOutputEntry *entry = getTypeOutputEntry(type);
 
-	getTypeOutputInfo(type, &outfuncoid, &isvarlena);
-	fmgr_info(outfuncoid, fmout);
-	temp = OutputFunctionCall(fmout, datum);
+	temp = OutputFunctionCall(&entry->outfunc, datum);
 	size = strlen(temp);
 	result = PyUnicode_Decode(temp, size, getPythonEncodingName(), NULL);
-	pfree(fmout);
+	pfree(temp);
 	return result;
 }
 
+/*
+ * Numerics are converted to floats, or to exact decimals for the columns
+ * asking for it with the numeric_as option.
+ */
 PyObject *
 datumNumberToPython(Datum datum, ConversionInfo * cinfo)
 {
-	ssize_t		numvalue = (ssize_t) DatumGetNumeric(datum);
-	char	   *tempvalue = (char *) DirectFunctionCall1(numeric_out,
-														 numvalue);
-	PyObject   *buffer = PyString_FromString(tempvalue),
-#if PY_MAJOR_VERSION >= 3
-			   *value = PyFloat_FromString(buffer);
-#else
-			   *value = PyFloat_FromString(buffer, NULL);
-#endif
-	Py_DECREF(buffer);
-	return value;
+	if (cinfo != NULL && cinfo->numeric_as_decimal)
+	{
+		char	   *tempvalue = DatumGetCString(DirectFunctionCall1(numeric_out,
+																	datum));
+		PyObject   *value;
+
+		importConverterClass(&decimalClass, "decimal.Decimal");
+		value = PyObject_CallFunction(decimalClass, "(s)", tempvalue);
+		pfree(tempvalue);
+		return value;
+	}
+	return PyFloat_FromDouble(DatumGetFloat8(
+						 DirectFunctionCall1(numeric_float8_no_overflow, datum)));
 }
 
 PyObject *
@@ -1429,7 +3394,7 @@ datumDateToPython(Datum datum, ConversionInfo * cinfo)
 	PyObject   *result;
 	fsec_t		fsec;
 
-	PyDateTime_IMPORT;
+	importDateTime();
 	datum = DirectFunctionCall1(date_timestamp, datum);
 	timestamp2tm(DatumGetTimestamp(datum), NULL, pg_tm_value, &fsec,
 				 NULL, NULL);
@@ -1446,7 +3411,7 @@ datumTimestampToPython(Datum datum, ConversionInfo * cinfo)
 	PyObject   *result;
 	fsec_t		fsec;
 
-	PyDateTime_IMPORT;
+	importDateTime();
 	timestamp2tm(DatumGetTimestamp(datum), NULL, pg_tm_value, &fsec,
 				 NULL, NULL);
 	result = PyDateTime_FromDateAndTime(pg_tm_value->tm_year,
@@ -1454,11 +3419,153 @@ datumTimestampToPython(Datum datum, ConversionInfo * cinfo)
 										pg_tm_value->tm_mday,
 										pg_tm_value->tm_hour,
 										pg_tm_value->tm_min,
-										pg_tm_value->tm_sec, 0);
+										pg_tm_value->tm_sec,
+#if PG_VERSION_NUM >= 100000
+										fsec);
+#else
+										0);
+#endif
 	pfree(pg_tm_value);
 	return result;
 }
 
+#if PG_VERSION_NUM >= 100000
+/*
+ * Fill a pg_tm from a python date, or datetime.
+ */
+static void
+pydatetimeToTm(PyObject *pyobject, struct pg_tm *tm, fsec_t *fsec)
+{
+	memset(tm, 0, sizeof(struct pg_tm));
+	tm->tm_year = PyDateTime_GET_YEAR(pyobject);
+	tm->tm_mon = PyDateTime_GET_MONTH(pyobject);
+	tm->tm_mday = PyDateTime_GET_DAY(pyobject);
+	*fsec = 0;
+	if (PyDateTime_Check(pyobject))
+	{
+		tm->tm_hour = PyDateTime_DATE_GET_HOUR(pyobject);
+		tm->tm_min = PyDateTime_DATE_GET_MINUTE(pyobject);
+		tm->tm_sec = PyDateTime_DATE_GET_SECOND(pyobject);
+		*fsec = PyDateTime_DATE_GET_MICROSECOND(pyobject);
+	}
+}
+
+/*
+ * The reverse of datumTimestampToPython.
+ * A time zone on the datetime is ignored, like timestamp_in does.
+ * A precision on the column requires rounding, left to the input function.
+ */
+static bool
+pydatetimeToTimestampDatum(PyObject *pyobject, ConversionInfo * cinfo,
+						   Datum *value)
+{
+	struct pg_tm tm;
+	fsec_t		fsec;
+	Timestamp	result;
+
+	if (!PyDateTime_CheckExact(pyobject) ||
+		(cinfo->atttypmod >= 0 && cinfo->atttypmod < MAX_TIMESTAMP_PRECISION))
+		return false;
+	pydatetimeToTm(pyobject, &tm, &fsec);
+	if (tm2timestamp(&tm, fsec, NULL, &result) != 0)
+		return false;
+	*value = TimestampGetDatum(result);
+	return true;
+}
+
+/*
+ * Aware datetimes are shifted by their utcoffset(), and naive ones are
+ * taken in the session time zone.
+ */
+static bool
+pydatetimeToTimestampTzDatum(PyObject *pyobject, ConversionInfo * cinfo,
+							 Datum *value)
+{
+	struct pg_tm tm;
+	fsec_t		fsec;
+	TimestampTz result;
+	PyObject   *p_offset = NULL;
+
+	if (!PyDateTime_CheckExact(pyobject) ||
+		(cinfo->atttypmod >= 0 && cinfo->atttypmod < MAX_TIMESTAMP_PRECISION))
+		return false;
+	pydatetimeToTm(pyobject, &tm, &fsec);
+	if (((PyDateTime_DateTime *) pyobject)->hastzinfo)
+	{
+		p_offset = PyObject_CallMethod(pyobject, "utcoffset", "()");
+		if (p_offset == NULL)
+		{
+			/* The generic path reports the error. */
+			PyErr_Clear();
+			return false;
+		}
+	}
+	if (p_offset != NULL && p_offset != Py_None)
+	{
+		PyDateTime_Delta *delta = (PyDateTime_Delta *) p_offset;
+		int			tz;
+
+		if (!PyDelta_Check(p_offset) || delta->microseconds != 0)
+		{
+			Py_DECREF(p_offset);
+			return false;
+		}
+		/* PostgreSQL counts time zones in seconds west of UTC. */
+		tz = -(delta->days * SECS_PER_DAY + delta->seconds);
+		Py_DECREF(p_offset);
+		if (tm2timestamp(&tm, fsec, &tz, &result) != 0)
+			return false;
+		*value = TimestampTzGetDatum(result);
+		return true;
+	}
+	Py_XDECREF(p_offset);
+	if (tm2timestamp(&tm, fsec, NULL, &result) != 0)
+		return false;
+	*value = DirectFunctionCall1(timestamp_timestamptz,
+								 TimestampGetDatum(result));
+	return true;
+}
+
+/*
+ * The time part of a datetime is dropped, like date_in does.
+ */
+static bool
+pydateToDateDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	struct pg_tm tm;
+	fsec_t		fsec;
+	Timestamp	result;
+
+	if (!PyDate_CheckExact(pyobject) && !PyDateTime_CheckExact(pyobject))
+		return false;
+	pydatetimeToTm(pyobject, &tm, &fsec);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	if (tm2timestamp(&tm, 0, NULL, &result) != 0)
+		return false;
+	*value = DirectFunctionCall1(timestamp_date, TimestampGetDatum(result));
+	return true;
+}
+
+/*
+ * A time zone on the time is ignored, like time_in does.
+ */
+static bool
+pytimeToTimeDatum(PyObject *pyobject, ConversionInfo * cinfo, Datum *value)
+{
+	TimeADT		result;
+
+	if (!PyTime_CheckExact(pyobject) ||
+		(cinfo->atttypmod >= 0 && cinfo->atttypmod < MAX_TIME_PRECISION))
+		return false;
+	result = ((((int64) PyDateTime_TIME_GET_HOUR(pyobject) * MINS_PER_HOUR) +
+			   PyDateTime_TIME_GET_MINUTE(pyobject)) * SECS_PER_MINUTE +
+			  PyDateTime_TIME_GET_SECOND(pyobject)) * USECS_PER_SEC +
+		PyDateTime_TIME_GET_MICROSECOND(pyobject);
+	*value = TimeADTGetDatum(result);
+	return true;
+}
+#endif
+
 PyObject *
 datumIntToPython(Datum datum, ConversionInfo * cinfo)
 {
@@ -1466,49 +3573,115 @@ datumIntToPython(Datum datum, ConversionInfo * cinfo)
 }
 
 PyObject *
-datumArrayToPython(Datum datum, Oid type, ConversionInfo * cinfo)
+datumBigIntToPython(Datum datum, ConversionInfo * cinfo)
 {
-#if PG_VERSION_NUM >= 90500
-	ArrayIterator iterator = array_create_iterator(DatumGetArrayTypeP(datum),
-												   0, NULL);
-# else
-	ArrayIterator iterator = array_create_iterator(DatumGetArrayTypeP(datum),
-												   0);
-# endif
+	return PyLong_FromLongLong(DatumGetInt64(datum));
+}
 
-	Datum		elem = (Datum) NULL;
-	bool		isnull;
-	PyObject   *result = PyList_New(0),
+PyObject *
+datumFloatToPython(Datum datum, Oid type, ConversionInfo * cinfo)
+{
+	if (type == FLOAT4OID)
+		return PyFloat_FromDouble((double) DatumGetFloat4(datum));
+	return PyFloat_FromDouble(DatumGetFloat8(datum));
+}
+
+PyObject *
+datumBoolToPython(Datum datum, ConversionInfo * cinfo)
+{
+	return PyBool_FromLong(DatumGetBool(datum));
+}
+
+/*
+ * Build nested lists for the dimensions of an array, consuming its
+ * deconstructed elements from *pos.
+ */
+static PyObject *
+arrayElementsToPython(Datum *elems, bool *nulls, int *pos, int ndim,
+					  int *dims, Oid elemtype, ConversionInfo * cinfo)
+{
+	PyObject   *result = PyList_New(dims[0]),
 			   *pyitem;
+	int			i;
 
-	while (array_iterate(iterator, &elem, &isnull))
+	for (i = 0; i < dims[0]; i++)
 	{
-		if (isnull)
+		if (ndim > 1)
+		{
+			pyitem = arrayElementsToPython(elems, nulls, pos, ndim - 1,
+										   dims + 1, elemtype, cinfo);
+		}
+		else if (nulls[*pos])
 		{
-			PyList_Append(result, Py_None);
+			Py_INCREF(Py_None);
+			pyitem = Py_None;
+			(*pos)++;
 		}
 		else
 		{
-			HeapTuple	tuple;
-			Form_pg_type typeStruct;
-
-			tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(type));
-			if (!HeapTupleIsValid(tuple))
-			{
-				elog(ERROR, "lookup failed for type %u",
-					 type);
-			}
-			typeStruct = (Form_pg_type) GETSTRUCT(tuple);
-			pyitem = datumToPython(elem, typeStruct->typelem, cinfo);
-			ReleaseSysCache(tuple);
-
-			PyList_Append(result, pyitem);
-			Py_DECREF(pyitem);
+			pyitem = datumToPython(elems[*pos], elemtype, cinfo);
+			(*pos)++;
 		}
+		if (pyitem == NULL)
+		{
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyList_SET_ITEM(result, i, pyitem);
 	}
 	return result;
 }
 
+static PyObject *
+arrayToPython(Datum datum, Oid type, ConversionInfo * cinfo, bool flatten)
+{
+	ArrayType  *array = DatumGetArrayTypeP(datum);
+	TypeOutputEntry *entry = getTypeOutputEntry(type);
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems,
+				pos = 0;
+	PyObject   *result;
+
+	if (ARR_NDIM(array) == 0)
+		return PyList_New(0);
+	deconstruct_array(array, entry->elemtype, entry->elmlen,
+					  entry->elmbyval, entry->elmalign,
+					  &elems, &nulls, &nelems);
+	if (flatten)
+		result = arrayElementsToPython(elems, nulls, &pos, 1, &nelems,
+									   entry->elemtype, cinfo);
+	else
+		result = arrayElementsToPython(elems, nulls, &pos, ARR_NDIM(array),
+									   ARR_DIMS(array), entry->elemtype, cinfo);
+	pfree(elems);
+	pfree(nulls);
+	return result;
+}
+
+/*
+ * Multi-dimensional arrays are converted to nested lists.
+ */
+PyObject *
+datumArrayToPython(Datum datum, Oid type, ConversionInfo * cinfo)
+{
+	return arrayToPython(datum, type, cinfo, false);
+}
+
+/*
+ * Convert the value of a qual.  For "column op ANY(array)" quals, the column
+ * is compared to every element whatever the dimensions of the array, so the
+ * value is a flat list of them.
+ */
+PyObject *
+qualValueToPython(Datum datum, Oid type, bool is_array,
+				  ConversionInfo * cinfo)
+{
+	if (is_array && OidIsValid(getTypeOutputEntry(type)->elemtype))
+		return arrayToPython(datum, type, cinfo, true);
+	return datumToPython(datum, type, cinfo);
+}
+
 
 PyObject *
 datumByteaToPython(Datum datum, ConversionInfo * cinfo)
@@ -1528,9 +3701,6 @@ datumByteaToPython(Datum datum, ConversionInfo * cinfo)
 PyObject *
 datumToPython(Datum datum, Oid type, ConversionInfo * cinfo)
 {
-	HeapTuple	tuple;
-	Form_pg_type typeStruct;
-
 	switch (type)
 	{
 		case BYTEAOID:
@@ -1544,19 +3714,19 @@ datumToPython(Datum datum, Oid type, ConversionInfo * cinfo)
 			return datumDateToPython(datum, cinfo);
 		case TIMESTAMPOID:
 			return datumTimestampToPython(datum, cinfo);
+		case INT2OID:
+			return PyLong_FromLong(DatumGetInt16(datum));
 		case INT4OID:
 			return datumIntToPython(datum, cinfo);
+		case INT8OID:
+			return datumBigIntToPython(datum, cinfo);
+		case FLOAT4OID:
+		case FLOAT8OID:
+			return datumFloatToPython(datum, type, cinfo);
+		case BOOLOID:
+			return datumBoolToPython(datum, cinfo);
 		default:
-			/* Case for the array ? */
-			tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(type));
-			if (!HeapTupleIsValid(tuple))
-			{
-				elog(ERROR, "lookup failed for type %u",
-					 type);
-			}
-			typeStruct = (Form_pg_type) GETSTRUCT(tuple);
-			ReleaseSysCache(tuple);
-			if ((typeStruct->typelem != 0) && (typeStruct->typlen == -1))
+			if (OidIsValid(getTypeOutputEntry(type)->elemtype))
 			{
 				/* Its an array. */
 				return datumArrayToPython(datum, type, cinfo);
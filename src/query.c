@@ -11,8 +11,10 @@
 #include "catalog/pg_database.h"
 #include "catalog/pg_operator.h"
 #include "mb/pg_wchar.h"
+#include "nodes/nodeFuncs.h"
 #include "utils/lsyscache.h"
 #include "miscadmin.h"
+#include "parser/parse_func.h"
 #include "parser/parsetree.h"
 #include "pg_config.h"
 
@@ -33,6 +35,18 @@ void extractClauseFromScalarArrayOpExpr(Relids base_relids,
 								   ScalarArrayOpExpr *node,
 								   List **quals);
 
+void extractClauseFromBoolExpr(Relids base_relids,
+						  BoolExpr *node,
+						  List **quals);
+
+void extractClauseFromExpression(Relids base_relids,
+							OpExpr *node,
+							List **quals);
+
+bool isColumnExpression(Node *node, Relids base_relids);
+
+static bool containsScanVariables(Node *node, void *context);
+
 char	   *getOperatorString(Oid opoid);
 
 MulticornBaseQual *makeQual(AttrNumber varattno, char *opname, Expr *value,
@@ -102,6 +116,66 @@ extractColumns(List *reltargetlist, List *restrictinfolist)
 	return columns;
 }
 
+/*
+ * Prepare the conversion of the elements of an array column, so that python
+ * sequences can be stored without building an array literal.
+ */
+static void
+initElementConversionInfo(ConversionInfo * cinfo, Oid elemtype)
+{
+	ConversionInfo *elemcinfo = palloc0(sizeof(ConversionInfo));
+	Oid			infuncoid;
+
+	elemcinfo->attinfunc = (FmgrInfo *) palloc0(sizeof(FmgrInfo));
+	getTypeInputInfo(elemtype, &infuncoid, &elemcinfo->attioparam);
+	fmgr_info(infuncoid, elemcinfo->attinfunc);
+	elemcinfo->atttypoid = elemtype;
+	/* The typmod of an array column applies to its elements. */
+	elemcinfo->atttypmod = cinfo->atttypmod;
+	elemcinfo->attrname = cinfo->attrname;
+	elemcinfo->attnum = cinfo->attnum;
+	elemcinfo->attndims = 0;
+	elemcinfo->need_quote = false;
+	/* Let the input function enforce the typmod, if any. */
+	if (cinfo->atttypmod < 0)
+		elemcinfo->pytodatum = getPyToDatumFunc(elemtype);
+	get_typlenbyvalalign(elemtype, &cinfo->elmlen, &cinfo->elmbyval,
+						 &cinfo->elmalign);
+	cinfo->is_array = true;
+	cinfo->elemcinfo = elemcinfo;
+}
+
+/*
+ * Look for the hstore(text[], text[]) function next to an hstore column type,
+ * so that python dicts can be stored without building an hstore literal.
+ */
+static void
+initHstoreConversionInfo(ConversionInfo * cinfo)
+{
+	HeapTuple	tp;
+	Form_pg_type typtup;
+	Oid			argtypes[2] = {TEXTARRAYOID, TEXTARRAYOID};
+	List	   *funcname = NIL;
+	Oid			funcoid;
+
+	tp = SearchSysCache1(TYPEOID, ObjectIdGetDatum(cinfo->atttypoid));
+	if (!HeapTupleIsValid(tp))
+		elog(ERROR, "cache lookup failed for type %u", cinfo->atttypoid);
+	typtup = (Form_pg_type) GETSTRUCT(tp);
+	if (strcmp(NameStr(typtup->typname), "hstore") == 0)
+		funcname = list_make2(makeString(get_namespace_name(typtup->typnamespace)),
+							  makeString("hstore"));
+	ReleaseSysCache(tp);
+	if (funcname == NIL)
+		return;
+	funcoid = LookupFuncName(funcname, 2, argtypes, true);
+	if (!OidIsValid(funcoid))
+		return;
+	cinfo->hstorefunc = (FmgrInfo *) palloc0(sizeof(FmgrInfo));
+	fmgr_info(funcoid, cinfo->hstorefunc);
+	cinfo->pytodatum = pydictToHstoreDatum;
+}
+
 /*
  * Initialize the array of "ConversionInfo" elements, needed to convert python
  * objects back to suitable postgresql data structures.
@@ -134,6 +208,18 @@ initConversioninfo(ConversionInfo ** cinfos, AttInMetadata *attinmeta)
 			cinfo->attnum = i + 1;
 			cinfo->attndims = attr->attndims;
 			cinfo->need_quote = false;
+			cinfo->pytodatum = getPyToDatumFunc(attr->atttypid);
+			if (cinfo->attndims > 0)
+			{
+				Oid			elemtype = get_element_type(attr->atttypid);
+
+				if (OidIsValid(elemtype))
+					initElementConversionInfo(cinfo, elemtype);
+			}
+			else if (cinfo->pytodatum == NULL)
+			{
+				initHstoreConversionInfo(cinfo);
+			}
 			cinfos[i] = cinfo;
 		}
 		else
@@ -143,6 +229,46 @@ initConversioninfo(ConversionInfo ** cinfos, AttInMetadata *attinmeta)
 	}
 }
 
+/*
+ * Read the numeric_as option, which is "float" by default and can be set on
+ * the table and overridden on each column.
+ */
+void
+initNumericConversion(ConversionInfo ** cinfos, int natts, Oid foreigntableid)
+{
+	ForeignTable *ftable = GetForeignTable(foreigntableid);
+	bool		as_decimal = false;
+	ListCell   *lc;
+	int			i;
+
+	foreach(lc, ftable->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "numeric_as") == 0)
+			as_decimal = strcmp(defGetString(def), "decimal") == 0;
+	}
+	for (i = 0; i < natts; i++)
+	{
+		if (cinfos[i] == NULL)
+			continue;
+		cinfos[i]->numeric_as_decimal = as_decimal;
+		/* Only numeric columns, or arrays of numerics, look at it */
+		if (cinfos[i]->atttypoid != NUMERICOID &&
+			(cinfos[i]->elemcinfo == NULL ||
+			 cinfos[i]->elemcinfo->atttypoid != NUMERICOID))
+			continue;
+		foreach(lc, GetForeignColumnOptions(foreigntableid, cinfos[i]->attnum))
+		{
+			DefElem    *def = (DefElem *) lfirst(lc);
+
+			if (strcmp(def->defname, "numeric_as") == 0)
+				cinfos[i]->numeric_as_decimal =
+					strcmp(defGetString(def), "decimal") == 0;
+		}
+	}
+}
+
 
 char *
 getOperatorString(Oid opoid)
@@ -324,6 +450,9 @@ extractRestrictions(Relids base_relids,
 											   (ScalarArrayOpExpr *) node,
 											   quals);
 			break;
+		case T_BoolExpr:
+			extractClauseFromBoolExpr(base_relids, (BoolExpr *) node, quals);
+			break;
 		default:
 			{
 				ereport(WARNING,
@@ -352,24 +481,171 @@ extractClauseFromOpExpr(Relids base_relids,
 {
 	Var		   *left;
 	Expr	   *right;
+	OpExpr	   *canonical;
 
 	/* Use a "canonical" version of the op expression, to ensure that the */
 	/* left operand is a Var on our relation. */
-	op = canonicalOpExpr(op, base_relids);
-	if (op)
+	canonical = canonicalOpExpr(op, base_relids);
+	if (canonical)
 	{
-		left = list_nth(op->args, 0);
-		right = list_nth(op->args, 1);
+		left = list_nth(canonical->args, 0);
+		right = list_nth(canonical->args, 1);
 		/* Do not add it if it either contains a mutable function, or makes */
 		/* self references in the right hand side. */
 		if (!(contain_volatile_functions((Node *) right) ||
 			  bms_is_subset(base_relids, pull_varnos((Node *) right))))
 		{
 			*quals = lappend(*quals, makeQual(left->varattno,
-											  getOperatorString(op->opno),
+											  getOperatorString(canonical->opno),
 											  right, false, false));
+			return;
+		}
+	}
+	/* Functions of the columns, or comparisons between them, may still be */
+	/* given as an expression. */
+	extractClauseFromExpression(base_relids, op, quals);
+}
+
+/*
+ *	Whether an expression is only made of columns of our relation, constants
+ *	and functions of those.  *has_column is set if it references a column.
+ */
+static bool
+isPushableExpression(Node *node, Relids base_relids, bool *has_column)
+{
+	Var		   *var;
+	ListCell   *lc;
+
+	switch (nodeTag(node))
+	{
+		case T_Var:
+			var = (Var *) node;
+			*has_column = true;
+			return bms_is_member(var->varno, base_relids) &&
+				var->varlevelsup == 0 && var->varattno >= 1;
+		case T_Const:
+			return true;
+		case T_RelabelType:
+			return isPushableExpression((Node *) ((RelabelType *) node)->arg,
+										base_relids, has_column);
+		case T_FuncExpr:
+			if (((FuncExpr *) node)->funcretset)
+			{
+				return false;
+			}
+			foreach(lc, ((FuncExpr *) node)->args)
+			{
+				if (!isPushableExpression(lfirst(lc), base_relids, has_column))
+				{
+					return false;
+				}
+			}
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ *	Whether an expression can be given to python as a function of the
+ *	columns, or as a column itself.
+ */
+bool
+isColumnExpression(Node *node, Relids base_relids)
+{
+	bool		has_column = false;
+
+	return isPushableExpression(node, base_relids, &has_column) && has_column;
+}
+
+/*
+ *	Whether an expression references something which may change between two
+ *	executions of a scan: a column, a parameter set by the executor, or a
+ *	subquery.
+ */
+static bool
+containsScanVariables(Node *node, void *context)
+{
+	if (node == NULL)
+	{
+		return false;
+	}
+	if (IsA(node, Param))
+	{
+		/* Query parameters are fixed for the whole execution. */
+		return ((Param *) node)->paramkind != PARAM_EXTERN;
+	}
+	if (IsA(node, Var) || IsA(node, SubPlan) ||
+		IsA(node, AlternativeSubPlan))
+	{
+		return true;
+	}
+	return expression_tree_walker(node, containsScanVariables, context);
+}
+
+/*
+ *	Whether an expression keeps the same value for the whole execution of the
+ *	query, so that it only has to be evaluated once: it only calls stable or
+ *	immutable functions, of values which do not change either.
+ */
+bool
+isStableExpression(Expr *expr)
+{
+	return !(contain_volatile_functions((Node *) expr) ||
+			 containsScanVariables((Node *) expr, NULL));
+}
+
+/*
+ *	Convert an operator applied to functions of the columns, such as
+ *	lower(name) = 'a', or to several columns, to an expression qual.  The
+ *	left operand is always such an expression, and the right one may also be
+ *	a value, constant or computed by the executor.
+ */
+void
+extractClauseFromExpression(Relids base_relids,
+							OpExpr *op,
+							List **quals)
+{
+	Oid			opoid = op->opno;
+	Node	   *left,
+			   *right;
+	bool		right_is_param;
+	MulticornExprQual *result;
+
+	if (list_length(op->args) != 2 ||
+		contain_volatile_functions((Node *) op))
+	{
+		return;
+	}
+	left = unnestClause(list_nth(op->args, 0));
+	right = unnestClause(list_nth(op->args, 1));
+	if (!isColumnExpression(left, base_relids))
+	{
+		Node	   *tmp = left;
+
+		opoid = get_commutator(opoid);
+		if (!OidIsValid(opoid) || !isColumnExpression(right, base_relids))
+		{
+			return;
 		}
+		left = right;
+		right = tmp;
+	}
+	right_is_param = !(IsA(right, Const) ||
+					   isColumnExpression(right, base_relids));
+	/* A value computed by the executor cannot depend on the row itself. */
+	if (right_is_param && bms_overlap(base_relids, pull_varnos(right)))
+	{
+		return;
 	}
+	result = palloc0(sizeof(MulticornExprQual));
+	result->right_is_param = right_is_param;
+	result->base.right_type = T_OpExpr;
+	result->base.varattno = InvalidAttrNumber;
+	result->base.opname = getOperatorString(opoid);
+	result->left = (Expr *) left;
+	result->right = (Expr *) right;
+	*quals = lappend(*quals, result);
 }
 
 void
@@ -397,6 +673,51 @@ extractClauseFromScalarArrayOpExpr(Relids base_relids,
 }
 
 
+/*
+ *	Convert an AND, OR or NOT expression whose arguments can all be converted
+ *	themselves.  Otherwise, nothing is added: the fdw would see an OR with
+ *	some of its alternatives missing, and filter out rows it should return.
+ */
+void
+extractClauseFromBoolExpr(Relids base_relids,
+						  BoolExpr *node,
+						  List **quals)
+{
+	List	   *args = NIL;
+	ListCell   *lc;
+	MulticornBoolQual *result;
+
+	foreach(lc, node->args)
+	{
+		Expr	   *arg = (Expr *) lfirst(lc);
+		int			nargs = list_length(args);
+
+		switch (nodeTag(arg))
+		{
+			case T_OpExpr:
+			case T_NullTest:
+			case T_ScalarArrayOpExpr:
+			case T_BoolExpr:
+				extractRestrictions(base_relids, arg, &args);
+				break;
+			default:
+				break;
+		}
+		/* Expression quals are only given to the fdws asking for them. */
+		if (list_length(args) != nargs + 1 ||
+			((MulticornBaseQual *) llast(args))->right_type == T_OpExpr)
+		{
+			return;
+		}
+	}
+	result = palloc0(sizeof(MulticornBoolQual));
+	result->base.right_type = T_BoolExpr;
+	result->base.varattno = InvalidAttrNumber;
+	result->boolop = node->boolop;
+	result->args = args;
+	*quals = lappend(*quals, result);
+}
+
 /*
  *	Convert a "NullTest" (IS NULL, or IS NOT NULL)
  *	to a suitable intermediate representation.
@@ -0,0 +1,472 @@
+/*-------------------------------------------------------------------------
+ *
+ * The Multicorn Foreign Data Wrapper allows you to fetch foreign data in
+ * Python in your PostgreSQL.
+ *
+ * This module implements the read-only mappings given to the insert and
+ * update methods of the foreign data wrappers with lazy_rows set.  Columns
+ * are converted from the slot the first time they are looked up.
+ *
+ * This software is released under the postgresql licence
+ *
+ * author: Kozea
+ *
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <Python.h>
+#include "postgres.h"
+#include "multicorn.h"
+#include "access/xact.h"
+#include "executor/tuptable.h"
+#include "utils/resowner.h"
+
+
+typedef struct MulticornRow
+{
+	PyObject_HEAD
+	/* The row being modified, NULL once the callback has returned */
+	TupleTableSlot *slot;
+	ConversionInfo **cinfos;
+	/* Column names in table order, and the attribute index of each name */
+	PyObject   *names;
+	PyObject   *indexes;
+	/* Columns converted so far */
+	PyObject   *values;
+}	MulticornRow;
+
+static PyTypeObject MulticornRowType;
+
+static void
+rowDealloc(MulticornRow * self)
+{
+	Py_XDECREF(self->names);
+	Py_XDECREF(self->indexes);
+	Py_XDECREF(self->values);
+	PyObject_Del(self);
+}
+
+/*
+ * Convert a column of the slot.  This runs under python, so PostgreSQL
+ * errors must not jump over the python frames: like plpython does for its
+ * SPI calls, the conversion runs in a subtransaction, rolled back on error
+ * to clean up after it before python gets a ValueError instead.
+ */
+static PyObject *
+rowConvertColumn(MulticornRow * self, int attidx)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	PyObject   *volatile result = NULL;
+
+	BeginInternalSubTransaction(NULL);
+	/* Keep the result out of the subtransaction context */
+	MemoryContextSwitchTo(oldcontext);
+	PG_TRY();
+	{
+		bool		isnull;
+		Datum		value = slot_getattr(self->slot, attidx + 1, &isnull);
+
+		if (isnull)
+		{
+			Py_INCREF(Py_None);
+			result = Py_None;
+		}
+		else
+		{
+			result = datumToPython(value, self->cinfos[attidx]->atttypoid,
+								   self->cinfos[attidx]);
+		}
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+		Py_XDECREF(result);
+		result = NULL;
+		PyErr_SetString(PyExc_ValueError, edata->message);
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+	return result;
+}
+
+static PyObject *
+rowLookup(MulticornRow * self, PyObject *key, bool *found)
+{
+	PyObject   *value = PyDict_GetItem(self->values, key),
+			   *p_index;
+
+	*found = true;
+	if (value != NULL)
+	{
+		Py_INCREF(value);
+		return value;
+	}
+	p_index = PyDict_GetItem(self->indexes, key);
+	if (p_index == NULL)
+	{
+		*found = false;
+		return NULL;
+	}
+	if (self->slot == NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError,
+						"row used after the end of its callback");
+		return NULL;
+	}
+	value = rowConvertColumn(self, (int) PyLong_AsLong(p_index));
+	if (value != NULL && PyDict_SetItem(self->values, key, value) != 0)
+	{
+		Py_DECREF(value);
+		return NULL;
+	}
+	return value;
+}
+
+static PyObject *
+rowGetItem(MulticornRow * self, PyObject *key)
+{
+	bool		found;
+	PyObject   *value = rowLookup(self, key, &found);
+
+	if (!found)
+	{
+		PyErr_SetObject(PyExc_KeyError, key);
+	}
+	return value;
+}
+
+static Py_ssize_t
+rowLength(MulticornRow * self)
+{
+	return PyList_Size(self->names);
+}
+
+static int
+rowContains(MulticornRow * self, PyObject *key)
+{
+	return PyDict_Contains(self->indexes, key);
+}
+
+static PyObject *
+rowIter(MulticornRow * self)
+{
+	return PyObject_GetIter(self->names);
+}
+
+static PyObject *
+rowGet(MulticornRow * self, PyObject *args)
+{
+	PyObject   *key,
+			   *p_default = Py_None,
+			   *value;
+	bool		found;
+
+	if (!PyArg_ParseTuple(args, "O|O", &key, &p_default))
+	{
+		return NULL;
+	}
+	value = rowLookup(self, key, &found);
+	if (!found)
+	{
+		Py_INCREF(p_default);
+		return p_default;
+	}
+	return value;
+}
+
+static PyObject *
+rowKeys(MulticornRow * self)
+{
+	return PyList_GetSlice(self->names, 0, PyList_Size(self->names));
+}
+
+/*
+ * Build the list of values, or of (key, value) pairs, of every column.
+ */
+static PyObject *
+rowList(MulticornRow * self, bool with_keys)
+{
+	Py_ssize_t	i,
+				size = PyList_Size(self->names);
+	PyObject   *result = PyList_New(size);
+
+	for (i = 0; i < size; i++)
+	{
+		PyObject   *key = PyList_GET_ITEM(self->names, i),
+				   *value = rowGetItem(self, key);
+
+		if (value == NULL)
+		{
+			Py_DECREF(result);
+			return NULL;
+		}
+		if (with_keys)
+		{
+			PyObject   *item = PyTuple_Pack(2, key, value);
+
+			Py_DECREF(value);
+			value = item;
+		}
+		PyList_SET_ITEM(result, i, value);
+	}
+	return result;
+}
+
+/*
+ * Convert every column into a regular dictionary.
+ */
+static PyObject *
+rowToDict(MulticornRow * self)
+{
+	PyObject   *p_items = rowList(self, true),
+			   *result;
+
+	if (p_items == NULL)
+	{
+		return NULL;
+	}
+	result = PyDict_New();
+	if (PyDict_MergeFromSeq2(result, p_items, 1) != 0)
+	{
+		Py_CLEAR(result);
+	}
+	Py_DECREF(p_items);
+	return result;
+}
+
+/*
+ * Compare as the dictionary the row stands for.
+ */
+static PyObject *
+rowRichCompare(MulticornRow * self, PyObject *other, int op)
+{
+	PyObject   *p_dict,
+			   *p_other,
+			   *result;
+
+	if (op != Py_EQ && op != Py_NE)
+	{
+		Py_INCREF(Py_NotImplemented);
+		return Py_NotImplemented;
+	}
+	p_dict = rowToDict(self);
+	if (p_dict == NULL)
+	{
+		return NULL;
+	}
+	if (PyObject_TypeCheck(other, &MulticornRowType))
+	{
+		p_other = rowToDict((MulticornRow *) other);
+		if (p_other == NULL)
+		{
+			Py_DECREF(p_dict);
+			return NULL;
+		}
+	}
+	else
+	{
+		Py_INCREF(other);
+		p_other = other;
+	}
+	result = PyObject_RichCompare(p_dict, p_other, op);
+	Py_DECREF(p_other);
+	Py_DECREF(p_dict);
+	return result;
+}
+
+static PyObject *
+rowValues(MulticornRow * self)
+{
+	return rowList(self, false);
+}
+
+static PyObject *
+rowItems(MulticornRow * self)
+{
+	return rowList(self, true);
+}
+
+/*
+ * Show the values converted so far, and the names of the other columns.
+ */
+static PyObject *
+rowRepr(MulticornRow * self)
+{
+	PyObject   *p_pending = PyList_New(0),
+			   *p_format,
+			   *p_args,
+			   *result;
+	Py_ssize_t	i;
+
+	for (i = 0; i < PyList_Size(self->names); i++)
+	{
+		PyObject   *key = PyList_GET_ITEM(self->names, i);
+
+		if (PyDict_GetItem(self->values, key) == NULL)
+		{
+			PyList_Append(p_pending, key);
+		}
+	}
+	p_format = PyString_FromString("<multicorn.Row %r, not converted: %r>");
+	p_args = PyTuple_Pack(2, self->values, p_pending);
+	result = PyNumber_Remainder(p_format, p_args);
+	Py_DECREF(p_args);
+	Py_DECREF(p_format);
+	Py_DECREF(p_pending);
+	return result;
+}
+
+static PyMappingMethods rowMappingMethods = {
+	(lenfunc) rowLength,
+	(binaryfunc) rowGetItem,
+	NULL
+};
+
+static PySequenceMethods rowSequenceMethods = {
+	.sq_contains = (objobjproc) rowContains
+};
+
+static PyMethodDef rowMethods[] = {
+	{"get", (PyCFunction) rowGet, METH_VARARGS,
+	"Return the value of a column, or a default if there is no such column."},
+	{"keys", (PyCFunction) rowKeys, METH_NOARGS, "The column names."},
+	{"values", (PyCFunction) rowValues, METH_NOARGS, "The column values."},
+	{"items", (PyCFunction) rowItems, METH_NOARGS,
+	"The (column name, value) pairs."},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject MulticornRowType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "multicorn.Row",
+	.tp_basicsize = sizeof(MulticornRow),
+	.tp_dealloc = (destructor) rowDealloc,
+	.tp_repr = (reprfunc) rowRepr,
+	.tp_as_sequence = &rowSequenceMethods,
+	.tp_as_mapping = &rowMappingMethods,
+	.tp_hash = PyObject_HashNotImplemented,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "A row being inserted or updated, converted on access.",
+	.tp_richcompare = (richcmpfunc) rowRichCompare,
+	.tp_iter = (getiterfunc) rowIter,
+	.tp_methods = rowMethods
+};
+
+/*
+ * Ready the row type, and register it as a Mapping so that fdws can tell
+ * it from other values as they would a dictionary.
+ */
+static void
+registerRowType(void)
+{
+#if PY_MAJOR_VERSION >= 3
+	PyObject   *p_mapping = getClassString("collections.abc.Mapping");
+#else
+	PyObject   *p_mapping = getClassString("collections.Mapping");
+#endif
+	PyObject   *p_result;
+
+	if (PyType_Ready(&MulticornRowType) < 0)
+	{
+		Py_DECREF(p_mapping);
+		errorCheck();
+	}
+	p_result = PyObject_CallMethod(p_mapping, "register", "(O)",
+								   (PyObject *) &MulticornRowType);
+	Py_XDECREF(p_result);
+	Py_DECREF(p_mapping);
+	errorCheck();
+}
+
+/*
+ * Check whether the fdw asks for lazy rows, and if so prepare what they
+ * share for the whole modification.
+ */
+void
+initRowMapping(MulticornModifyState * modstate, int natts)
+{
+	PyObject   *p_lazy = PyObject_GetAttrString(modstate->fdw_instance,
+												"lazy_rows");
+	int			i;
+
+	if (p_lazy == NULL)
+	{
+		/* Not inheriting from ForeignDataWrapper */
+		PyErr_Clear();
+		return;
+	}
+	if (PyObject_IsTrue(p_lazy) == 1)
+	{
+		if (!(MulticornRowType.tp_flags & Py_TPFLAGS_READY))
+		{
+			registerRowType();
+		}
+		modstate->rowNames = PyList_New(0);
+		modstate->rowIndexes = PyDict_New();
+		for (i = 0; i < natts; i++)
+		{
+			PyObject   *p_name,
+					   *p_index;
+
+			if (modstate->cinfos[i] == NULL)
+				continue;
+			p_name = PyString_FromString(modstate->cinfos[i]->attrname);
+			p_index = PyLong_FromLong(i);
+			PyList_Append(modstate->rowNames, p_name);
+			PyDict_SetItem(modstate->rowIndexes, p_name, p_index);
+			Py_DECREF(p_name);
+			Py_DECREF(p_index);
+		}
+	}
+	Py_DECREF(p_lazy);
+	errorCheck();
+}
+
+/*
+ * Wrap the slot, for the duration of an insert or update call.
+ */
+PyObject *
+slotToRowMapping(TupleTableSlot *slot, MulticornModifyState * modstate)
+{
+	MulticornRow *row = PyObject_New(MulticornRow, &MulticornRowType);
+
+	row->slot = slot;
+	row->cinfos = modstate->cinfos;
+	Py_INCREF(modstate->rowNames);
+	row->names = modstate->rowNames;
+	Py_INCREF(modstate->rowIndexes);
+	row->indexes = modstate->rowIndexes;
+	row->values = PyDict_New();
+	return (PyObject *) row;
+}
+
+/*
+ * Cut the row from its slot once the callback has returned.  If the fdw
+ * kept a reference to it, the remaining columns are converted first.  When
+ * the callback raised, the reference may just be the traceback's, and the
+ * error is about to be reported anyway: nothing is converted then.
+ */
+void
+detachRowMapping(PyObject *p_row)
+{
+	MulticornRow *row = (MulticornRow *) p_row;
+
+	if (Py_REFCNT(p_row) > 1 && !PyErr_Occurred())
+	{
+		PyObject   *p_values = rowValues(row);
+
+		Py_XDECREF(p_values);
+	}
+	row->slot = NULL;
+}
@@ -0,0 +1,31 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    option1 'option1'
+);
+
+-- Test calling python without going through plpython
+SET multicorn.execution_mode = 'direct';
+select * from testmulticorn limit 2;
+
+ALTER foreign table testmulticorn options (ADD wrapper 'multicorn.evilwrapper.EvilDataWrapper');
+
+-- Test going through plpython
+SET multicorn.execution_mode = 'plpython';
+select * from testmulticorn limit 2;
+
+ALTER foreign table testmulticorn options (ADD wrapper 'multicorn.evilwrapper.EvilDataWrapper');
+
+SET multicorn.execution_mode = 'bogus';
+RESET multicorn.execution_mode;
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1,46 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+-- Test that the fetch size must be a positive integer
+CREATE foreign table testmulticorn (
+    test1 integer,
+    test2 integer
+) server multicorn_srv options (
+    test_type 'int',
+    fetch_size '0'
+);
+
+CREATE foreign table testmulticorn (
+    test1 integer,
+    test2 integer
+) server multicorn_srv options (
+    test_type 'int',
+    fetch_size 'many'
+);
+
+-- Test that it is only set on the server or the table
+ALTER user mapping FOR current_user server multicorn_srv options (ADD fetch_size '7');
+
+-- Rows are fetched seven at a time, the last batch being incomplete
+CREATE foreign table testmulticorn (
+    test1 integer,
+    test2 integer
+) server multicorn_srv options (
+    test_type 'int',
+    fetch_size '7'
+);
+
+select * from testmulticorn;
+
+select * from testmulticorn limit 3;
+
+-- Test that a rescan does not serve rows left from the previous batch
+select test1, (select count(*) from testmulticorn t2 where t2.test1 <= t1.test1) as cnt
+from testmulticorn t1 where test1 < 3;
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
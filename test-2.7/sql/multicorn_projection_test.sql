@@ -0,0 +1,24 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    nb_rows '3'
+);
+
+-- Only the columns in the target list are read from the returned dicts
+select test1 from testmulticorn;
+
+select test2 from testmulticorn where test1 like '%1';
+
+-- A whole-row reference needs every column
+select t from testmulticorn t;
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
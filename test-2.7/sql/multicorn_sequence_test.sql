@@ -58,5 +58,34 @@ CREATE foreign table testmulticorn3 (
 );
 select * from testmulticorn3 limit 1;
 
+CREATE foreign table testmulticorn4 (
+    test1 character varying,
+    test2 character varying,
+    test3 character varying
+) server multicorn_srv options (
+    test_type 'sequence',
+    projected_sequences 'true',
+    nb_rows '3'
+);
+
+-- Only the needed columns are returned, in table order
+select test3, test1 from testmulticorn4;
+
+select test2 from testmulticorn4 where test3 like '%1';
+
+-- A row with every column is refused when only some are requested
+CREATE foreign table testmulticorn5 (
+    test1 character varying,
+    test2 character varying,
+    test3 character varying
+) server multicorn_srv options (
+    test_type 'sequence',
+    test_subtype 'full_width',
+    projected_sequences 'true',
+    nb_rows '3'
+);
+
+select test3, test1 from testmulticorn5;
+
 DROP USER MAPPING FOR current_user SERVER multicorn_srv;
 DROP EXTENSION multicorn cascade;
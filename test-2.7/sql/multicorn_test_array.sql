@@ -0,0 +1,30 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test_int integer[],
+    test_text text[],
+    test_matrix integer[][],
+    test_numeric numeric[]
+) server multicorn_srv options (
+    test_type 'array',
+    nb_rows '3'
+);
+
+-- Lists and tuples are stored element by element, None as NULL
+select * from testmulticorn;
+
+select test_text[2] is null as n, test_matrix[2][1], array_dims(test_matrix) from testmulticorn;
+
+-- Arrays reach python as lists, nested for each dimension
+ALTER foreign table testmulticorn options (ADD row_id_column 'test_int');
+select test_int from testmulticorn where test_matrix = ARRAY[[1, 2], [3, 4]];
+insert into testmulticorn VALUES (ARRAY[1, NULL], ARRAY['a', 'b'], ARRAY[[1, 2], [3, 4]], ARRAY[0.5]);
+insert into testmulticorn VALUES ('{}', '{}', '{{{1}}}', NULL);
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1,28 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    bool_quals 'true'
+);
+
+-- OR and AND expressions are given as BoolQuals
+select * from testmulticorn where test1 = 'test1 1 0' or test2 = 'test2 1 1';
+
+select * from testmulticorn where test1 = 'test1 1 0' or (test2 = 'test2 1 1' and test1 is not null);
+
+-- Unless a part of them cannot be represented
+select * from testmulticorn where test1 = 'test1 1 0' or test2 = test1;
+
+-- Or the fdw does not ask for them
+ALTER foreign table testmulticorn options (SET bool_quals 'false');
+select * from testmulticorn where test1 = 'test1 1 0' or test2 = 'test2 1 1';
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1,24 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test_bytes bytea,
+    test_bytearray bytea,
+    test_memoryview bytea,
+    test_text text
+) server multicorn_srv options (
+    test_type 'bytes',
+    nb_rows '3'
+);
+
+-- Bytes-like objects are stored as they are
+select * from testmulticorn;
+
+select length(test_bytes), length(test_memoryview), length(test_text) from testmulticorn;
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1,28 @@
+SET client_min_messages=NOTICE;
+SET TIME ZONE 'Europe/Paris';
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test_timestamp timestamp,
+    test_timestamp0 timestamp(0),
+    test_naive timestamptz,
+    test_aware timestamptz,
+    test_date date,
+    test_time time
+) server multicorn_srv options (
+    test_type 'datetime',
+    nb_rows '3'
+);
+
+-- Microseconds and time zones are kept
+select * from testmulticorn;
+
+select test_timestamp from testmulticorn where test_timestamp = '2011-02-02 14:30:25.123456';
+
+RESET TIME ZONE;
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
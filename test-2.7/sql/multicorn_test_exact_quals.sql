@@ -0,0 +1,43 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    exact_quals 'true'
+);
+
+-- The equality quals are enforced by the fdw, and not checked again
+explain (costs off) select * from testmulticorn where test1 = 'test1 1 0' and test2 like 'test2%';
+
+explain (costs off) select * from testmulticorn where test1 = 'test1 1 0';
+
+select * from testmulticorn where test1 = 'test1 1 0';
+
+-- As well as IN lists, whose size is used to estimate the number of rows
+explain select * from testmulticorn where test1 in ('test1 1 0', 'test1 3 1');
+
+select * from testmulticorn where test1 in ('test1 1 0', 'test1 3 1');
+
+-- Multi-dimensional arrays are flattened: the column is compared to every element
+explain select * from testmulticorn where test1 = ANY('{{"test1 1 0","test1 3 1"},{"test1 2 2","other"}}');
+
+select * from testmulticorn where test1 = ANY('{{"test1 1 0","test1 3 1"},{"test1 2 2","other"}}');
+
+-- Unless the fdw does not claim them
+ALTER foreign table testmulticorn options (SET exact_quals 'false');
+explain (costs off) select * from testmulticorn where test1 = 'test1 1 0';
+
+select * from testmulticorn where test1 = 'test1 1 0';
+
+-- Only the given instances are claimed, not copies comparing equal to them
+ALTER foreign table testmulticorn options (SET exact_quals 'copies');
+explain (costs off) select * from testmulticorn where test1 = 'test1 1 0';
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
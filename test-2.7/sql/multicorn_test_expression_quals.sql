@@ -0,0 +1,50 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    expression_quals 'true'
+);
+
+-- Functions of the columns
+select * from testmulticorn where lower(test1) = 'test1 1 0';
+
+select * from testmulticorn where substr(test1, 1, 9) = 'test1 1 0';
+
+-- Functions of other schemas than pg_catalog are shown with theirs
+CREATE SCHEMA multicorn_test_schema;
+CREATE FUNCTION multicorn_test_schema.lower(value text) RETURNS text IMMUTABLE
+LANGUAGE plpgsql AS $$
+BEGIN
+    RETURN upper(value);
+END
+$$;
+select * from testmulticorn where multicorn_test_schema.lower(test1) = 'TEST1 1 0';
+DROP FUNCTION multicorn_test_schema.lower(text);
+DROP SCHEMA multicorn_test_schema;
+
+-- Comparisons between columns
+select * from testmulticorn where test1 = test2;
+
+-- Values computed by the executor
+select * from testmulticorn where lower(test1) = (select lower('TEST1 1 0'));
+
+-- Stable values are evaluated once, when the scan starts
+SET application_name = 'test1 1 0';
+select * from testmulticorn where test1 = current_setting('application_name');
+
+select * from testmulticorn where lower(test1) = current_setting('application_name');
+RESET application_name;
+
+-- ExpressionQuals are only given to the fdws asking for them
+ALTER foreign table testmulticorn options (SET expression_quals 'false');
+select * from testmulticorn where lower(test1) = 'test1 1 0';
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
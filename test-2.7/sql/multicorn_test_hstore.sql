@@ -0,0 +1,23 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE EXTENSION hstore;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test_hstore hstore
+) server multicorn_srv options (
+    test_type 'json',
+    nb_rows '3'
+);
+
+-- Dicts are stored without going through their python repr
+select * from testmulticorn;
+
+select test_hstore -> 'index' as index, test_hstore -> 'empty' is null as empty from testmulticorn;
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
+DROP EXTENSION hstore;
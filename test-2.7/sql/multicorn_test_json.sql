@@ -0,0 +1,22 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test_jsonb jsonb,
+    test_json json
+) server multicorn_srv options (
+    test_type 'json',
+    nb_rows '3'
+);
+
+-- Dicts and lists are stored without going through their python repr
+select * from testmulticorn;
+
+select test_jsonb -> 'nested' ->> 'quote' as quote, jsonb_typeof(test_jsonb -> 'ratio') as ratio, test_json -> 5 ->> 'key' as key from testmulticorn;
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1,35 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test_smallint smallint,
+    test_integer integer,
+    test_bigint bigint,
+    test_real real,
+    test_double double precision,
+    test_boolean boolean
+) server multicorn_srv options (
+    test_type 'numbers',
+    nb_rows '5'
+);
+
+-- Integers are accepted for floating point columns
+select * from testmulticorn;
+
+-- Values out of range still go through the input functions
+ALTER foreign table testmulticorn options (ADD test_subtype 'overflow');
+select test_smallint from testmulticorn;
+
+-- Numbers and booleans reach python as such in quals and inserts
+ALTER foreign table testmulticorn options (DROP test_subtype, ADD row_id_column 'test_smallint');
+select test_smallint from testmulticorn where test_bigint = ANY(ARRAY[0, 2199023255552]);
+insert into testmulticorn VALUES (1, 2, 3, 1.5, 2.5, true);
+-- Reals are widened to doubles
+insert into testmulticorn VALUES (4, 5, 6, 0.1, 0.1, false);
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1,51 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+-- The planner test type makes the table big enough to be scanned once per
+-- value, with a parameterized path.
+CREATE foreign table testmulticorn (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    test_type 'planner',
+    nb_rows '3'
+);
+
+-- Every rescan executes the query again, even for repeated values
+select v.x, m.test2 from (values ('test1 1 0'), ('test1 1 0'), ('test1 3 1')) v(x) join testmulticorn m on m.test1 = v.x;
+
+-- Stable values are evaluated once, not on every rescan
+CREATE FUNCTION multicorn_test_stable(value text) RETURNS text STABLE
+LANGUAGE plpgsql AS $$
+BEGIN
+    PERFORM set_config('multicorn_test.calls',
+                       (current_setting('multicorn_test.calls')::int + 1)::text,
+                       false);
+    RETURN value;
+END
+$$;
+SET multicorn_test.calls = 0;
+PREPARE stable_join AS select v.x, m.test2 from (values ('test1 1 0'), ('test1 3 1')) v(x) join testmulticorn m on m.test1 = v.x and m.test2 = multicorn_test_stable('test2 2 0');
+EXECUTE stable_join;
+SET multicorn_test.calls = 0;
+EXECUTE stable_join;
+SELECT current_setting('multicorn_test.calls') AS calls;
+DROP FUNCTION multicorn_test_stable(text);
+
+-- Quals kept by the fdw do not change with the next executions
+CREATE foreign table testkeep (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    test_type 'planner',
+    test_subtype 'keep_quals',
+    nb_rows '3'
+);
+select v.x, m.test2 from (values ('test1 1 0'), ('test1 3 1')) v(x) join testkeep m on m.test1 = v.x;
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1,42 @@
+SET client_min_messages=NOTICE;
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test_decimal numeric,
+    test_scaled numeric(8, 1),
+    test_int numeric,
+    test_nan numeric,
+    test_uuid uuid
+) server multicorn_srv options (
+    test_type 'types',
+    nb_rows '3'
+);
+
+-- Decimals, integers and UUIDs have their own converters
+select * from testmulticorn;
+
+select test_uuid, test_scaled * 2 from testmulticorn where test_uuid = '00000000-0000-0001-0000-000000000001';
+
+-- Special decimals, exponents, signs and zeros
+CREATE foreign table testspecial (
+    test_special numeric
+) server multicorn_srv options (
+    test_type 'types',
+    nb_rows '7'
+);
+select * from testspecial;
+
+-- Numerics reach python as floats, or as decimals with numeric_as
+select test_int from testmulticorn where test_decimal = ANY(ARRAY[0.1, 1.10]);
+ALTER foreign table testmulticorn options (ADD numeric_as 'double');
+ALTER server multicorn_srv options (ADD numeric_as 'decimal');
+ALTER foreign table testmulticorn options (ADD numeric_as 'decimal');
+ALTER foreign table testmulticorn alter column test_int options (numeric_as 'float');
+select test_int from testmulticorn where test_decimal = ANY(ARRAY[0.1, 1.10]) and test_int = ANY(ARRAY[999, 1.5]);
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1,36 @@
+CREATE EXTENSION multicorn;
+CREATE server multicorn_srv foreign data wrapper multicorn options (
+    wrapper 'multicorn.testfdw.TestForeignDataWrapper'
+);
+CREATE user mapping FOR current_user server multicorn_srv options (usermapping 'test');
+
+CREATE foreign table testmulticorn (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    row_id_column 'test1',
+    lazy_rows 'true'
+);
+
+-- Rows are given as mappings converting columns on access, only the looked
+-- up ones are converted
+insert into testmulticorn(test1, test2) VALUES ('test', 'test2');
+insert into testmulticorn(test1) VALUES ('test');
+update testmulticorn set test2 = 'changed' where test1 = 'test1 1 0';
+
+-- Rows kept after the callback are converted in full when it returns
+CREATE foreign table testmulticorn2 (
+    test1 character varying,
+    test2 character varying
+) server multicorn_srv options (
+    lazy_rows 'true',
+    test_subtype 'keep_rows'
+);
+insert into testmulticorn2 VALUES ('test', 'test2'), ('other', 'other2');
+
+-- Rows are mappings, and compare equal to the dictionaries they stand for
+ALTER foreign table testmulticorn2 options (SET test_subtype 'compare_rows');
+insert into testmulticorn2 VALUES ('test', 'test2');
+
+DROP USER MAPPING FOR current_user SERVER multicorn_srv;
+DROP EXTENSION multicorn cascade;
@@ -0,0 +1 @@
+../../test-2.7/sql/multicorn_fetch_size_test.sql
\ No newline at end of file
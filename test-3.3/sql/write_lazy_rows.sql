@@ -0,0 +1 @@
+../../test-2.7/sql/write_lazy_rows.sql
\ No newline at end of file